@@ -0,0 +1,77 @@
+// Measures what static dispatch buys on the echo protocol: the same read loop
+// (sv::connection) driven through the runtime handler_t vtable and through the
+// inlined sv::echo_static_handler, both staging output in handler_out_t, so
+// the difference between them is dispatch and codegen. A third run has the
+// static handler stage into sv::static_out instead, to show what the output
+// container costs on top. No sockets are involved; each "recv" is a memcpy
+// from a synthetic corpus.
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "handler.h"
+#include "reactor.hpp"
+
+// Frames of 1..64 shifted letters with some bytes between them that the
+// protocol has to skip.
+static std::vector<uint8_t> make_corpus(size_t size) {
+  std::vector<uint8_t> corpus;
+  corpus.reserve(size);
+  srand(42);
+  while (corpus.size() < size) {
+    corpus.push_back('^');
+    for (int i = rand() % 64; i >= 0; i--) corpus.push_back('a' + rand() % 26);
+    corpus.push_back('$');
+    for (int i = rand() % 8; i > 0; i--) corpus.push_back('0' + rand() % 10);
+  }
+  corpus.resize(size);
+  return corpus;
+}
+
+template <typename Handler>
+static void run(const char* label, const std::vector<uint8_t>& corpus, int rounds) {
+  static sv::connection<Handler> conn;
+  uint64_t checksum = 0;
+
+  auto t1 = std::chrono::steady_clock::now();
+  for (int round = 0; round < rounds; round++) {
+    conn.connect();
+    conn.sent(conn.out.len);
+    for (size_t pos = 0; pos < corpus.size();) {
+      int n = conn.recv_space();
+      if ((size_t)n > corpus.size() - pos) n = corpus.size() - pos;
+      memcpy(&conn.recvbuf[conn.recvbuf_end], &corpus[pos], n);
+      pos += n;
+      conn.received(n);
+      const uint8_t* out;
+      int len = sv::out_peek(conn.out, &out);
+      if (len > 0) checksum += out[len - 1];
+      conn.sent(len);
+    }
+    conn.close();
+  }
+  auto t2 = std::chrono::steady_clock::now();
+
+  double secs = std::chrono::duration<double>(t2 - t1).count();
+  double bytes = (double)corpus.size() * rounds;
+  printf("%-18s %8.1f MB/s %8.3f ns/byte (checksum %llu)\n", label, bytes / secs / 1e6, secs * 1e9 / bytes,
+         (unsigned long long)checksum);
+}
+
+int main(int argc, char** argv) {
+  size_t size = 16 << 20;
+  int rounds = argc >= 2 ? atoi(argv[1]) : 10;
+  std::vector<uint8_t> corpus = make_corpus(size);
+
+  // echo_static_handler is the scalar switch, so compare it with the same
+  // scanner behind the vtable.
+  putenv((char*)"ECHO_SCAN=scalar");
+  sv::dynamic_handler::vtable = &echo_handler;
+  run<sv::dynamic_handler>("dynamic", corpus, rounds);
+  run<sv::echo_static_handler<1024, 1024, handler_out_t>>("static", corpus, rounds);
+  run<sv::echo_static_handler<>>("static+static_out", corpus, rounds);
+  return 0;
+}
@@ -0,0 +1,155 @@
+// End-to-end benchmark of a running server speaking the "^...$" echo
+// protocol: the memory it holds per idle connection, and the round-trip
+// latency of small messages on one active connection while those idle ones
+// stay open. Results are printed as JSON in Google Benchmark's layout, like
+// protocol-bench:
+//
+//   latency-bench port [idle_connections] [pings] [server_pid] > results.json
+//
+// Memory is only measured when server_pid is given, from the growth of the
+// server's private bytes as the idle connections are opened. To compare
+// models, run it against e.g.
+//
+//   iocp-server                          (completion-based)
+//   iocp-server, PROFILE=LOW_LATENCY     (no buffers while idle, spinning)
+//   select-server, BACKEND=IOCP          (readiness-based)
+#include <winsock2.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Payload of every ping; the echo comes back with each byte incremented.
+#define PING_PAYLOAD "abcdefgh"
+#define PING_LEN (sizeof(PING_PAYLOAD) - 1)
+
+// Gives the server time to settle after the idle connections are opened.
+#define SETTLE_MS 500
+
+static int connect_to_server(int portnum) {
+  int sockfd = (int)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sockfd == (int)INVALID_SOCKET) {
+    perror_die("socket");
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(portnum);
+  if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+    perror_die("connect");
+  }
+  // Pings are tiny; don't let Nagle hold them back.
+  int one = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+  return sockfd;
+}
+
+// Receives exactly len bytes; dies if the server closes or fails first.
+static void recv_exactly(int sockfd, char* buf, int len) {
+  while (len > 0) {
+    int n = recv(sockfd, buf, len, 0);
+    if (n <= 0) {
+      die("server closed the connection or failed (%d)", n);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// Bytes of private memory committed by the process, or 0 if unknown.
+static size_t private_bytes(HANDLE process) {
+  PROCESS_MEMORY_COUNTERS_EX counters;
+  if (!process || !GetProcessMemoryInfo(process, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+    return 0;
+  }
+  return counters.PrivateUsage;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    die("usage: %s port [idle_connections] [pings] [server_pid]", argv[0]);
+  }
+  if (initializeWinsock() != 0) {
+    return 1;
+  }
+  int portnum = atoi(argv[1]);
+  int num_idle = argc >= 3 ? atoi(argv[2]) : 1000;
+  int num_pings = argc >= 4 ? atoi(argv[3]) : 10000;
+  HANDLE server = NULL;
+  if (argc >= 5) {
+    server = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)atoi(argv[4]));
+    if (!server) {
+      die("can't open server process %s: %lu", argv[4], GetLastError());
+    }
+  }
+  if (num_idle < 0 || num_pings < 1) {
+    die("need idle_connections >= 0 and pings >= 1");
+  }
+
+  // The active connection comes first, so that its buffers are counted in
+  // the baseline.
+  int active = connect_to_server(portnum);
+  char greeting;
+  recv_exactly(active, &greeting, 1);
+  Sleep(SETTLE_MS);
+  size_t baseline = private_bytes(server);
+
+  int* idle = (int*)xmalloc(sizeof(int) * (num_idle ? num_idle : 1));
+  for (int i = 0; i < num_idle; i++) {
+    idle[i] = connect_to_server(portnum);
+  }
+  for (int i = 0; i < num_idle; i++) {
+    recv_exactly(idle[i], &greeting, 1);
+  }
+  Sleep(SETTLE_MS);
+  size_t loaded = private_bytes(server);
+
+  const char ping[] = "^" PING_PAYLOAD "$";
+  char pong[PING_LEN];
+  uint64_t* rtts = (uint64_t*)xmalloc(sizeof(uint64_t) * num_pings);
+  uint64_t total_ns = 0;
+  for (int i = 0; i < num_pings; i++) {
+    uint64_t t1 = monotonic_ns();
+    if (send_all(active, ping, sizeof(ping) - 1) == SOCKET_ERROR) {
+      perror_die("send");
+    }
+    recv_exactly(active, pong, PING_LEN);
+    rtts[i] = monotonic_ns() - t1;
+    total_ns += rtts[i];
+    if (pong[0] != PING_PAYLOAD[0] + 1) {
+      die("unexpected reply: is the server speaking PROTOCOL=echo?");
+    }
+  }
+  qsort(rtts, num_pings, sizeof(uint64_t), compare_u64);
+
+  printf("{\n  \"context\": {\"idle_connections\": %d, \"pings\": %d},\n  \"benchmarks\": [", num_idle, num_pings);
+  if (server && num_idle > 0) {
+    printf("\n    {\"name\": \"idle_memory\", \"iterations\": %d, \"private_bytes\": %zu, "
+           "\"bytes_per_connection\": %.0f},",
+           num_idle, loaded, loaded > baseline ? (double)(loaded - baseline) / num_idle : 0.0);
+  }
+  printf("\n    {\"name\": \"ping_latency\", \"iterations\": %d, \"real_time\": %.0f, \"time_unit\": \"ns\", "
+         "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+         num_pings, (double)total_ns / num_pings, (unsigned long long)rtts[num_pings / 2],
+         (unsigned long long)rtts[(int)(num_pings * 0.99)], (unsigned long long)rtts[(int)(num_pings * 0.999)],
+         (unsigned long long)rtts[num_pings - 1]);
+  printf("\n  ]\n}\n");
+
+  for (int i = 0; i < num_idle; i++) {
+    closesocket(idle[i]);
+  }
+  closesocket(active);
+  free(idle);
+  free(rtts);
+  cleanupWinsock();
+  return 0;
+}
@@ -0,0 +1,128 @@
+// Microbenchmark of the "^...$" protocol engine in isolation: every echo_scan
+// variant over a set of synthetic corpora, fed the way an engine would (one
+// recv-sized read at a time, output drained after each read). Results are
+// printed as JSON in Google Benchmark's layout, so the usual comparison tools
+// can track them:
+//
+//   protocol-bench [min_seconds] > results.json
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "echo-scan.h"
+#include "handler.h"
+#include "utils.h"
+
+typedef struct {
+  const char* name;
+  uint8_t* data;
+  int len;
+  // Bytes handed to the scanner per call, i.e. the size of one read.
+  int read_size;
+} corpus_t;
+
+typedef struct {
+  const char* name;
+  echo_scan_fn scan;
+} variant_t;
+
+static const variant_t variants[] = {
+    {"scalar", echo_scan_scalar},
+    {"simd", echo_scan_simd},
+    {"dfa", echo_scan_dfa},
+};
+
+#define CORPUS_SIZE (4 << 20)
+#define READ_SIZE 1024
+#define NUM_CORPORA 5
+
+// Fills a corpus with frames of frame_min..frame_max payload bytes, each
+// preceded by up to max_garbage bytes the protocol must skip.
+static corpus_t make_corpus(const char* name, int frame_min, int frame_max, int max_garbage, int read_size) {
+  corpus_t corpus = {name, (uint8_t*)xmalloc(CORPUS_SIZE), 0, read_size};
+  while (corpus.len < CORPUS_SIZE) {
+    for (int i = max_garbage ? rand() % (max_garbage + 1) : 0; i > 0 && corpus.len < CORPUS_SIZE; i--) {
+      // Garbage never contains '^', so it can't open a frame.
+      corpus.data[corpus.len++] = 'A' + rand() % 26;
+    }
+    if (corpus.len < CORPUS_SIZE) corpus.data[corpus.len++] = '^';
+    int payload = frame_min + rand() % (frame_max - frame_min + 1);
+    for (int i = 0; i < payload && corpus.len < CORPUS_SIZE; i++) {
+      corpus.data[corpus.len++] = 'a' + rand() % 26;
+    }
+    if (corpus.len < CORPUS_SIZE) corpus.data[corpus.len++] = '$';
+  }
+  return corpus;
+}
+
+// Scans the whole corpus once; returns the number of frames and accumulates
+// the bytes emitted into *checksum.
+static long long scan_corpus(const variant_t* variant, const corpus_t* corpus, handler_out_t* out, uint64_t* checksum) {
+  ProcessingState state = WAIT_FOR_MSG;
+  long long frames = 0;
+  for (int pos = 0; pos < corpus->len; pos += corpus->read_size) {
+    int n = corpus->len - pos < corpus->read_size ? corpus->len - pos : corpus->read_size;
+    frames += variant->scan(&state, &corpus->data[pos], n, out);
+
+    // Drain like an engine would after sending.
+    const uint8_t* data;
+    int len;
+    while ((len = handler_out_peek(out, &data)) > 0) {
+      for (int i = 0; i < len; i += 64) *checksum = *checksum * 31 + data[i];
+      *checksum += len;
+      handler_out_consume(out, len);
+    }
+  }
+  return frames;
+}
+
+int main(int argc, char** argv) {
+  double min_seconds = argc >= 2 ? atof(argv[1]) : 0.5;
+
+  srand(42);
+  corpus_t corpora[NUM_CORPORA] = {
+      make_corpus("tiny_frames", 1, 8, 2, READ_SIZE),
+      make_corpus("huge_frames", 32 << 10, 256 << 10, 2, READ_SIZE),
+      make_corpus("mostly_garbage", 1, 16, 4096, READ_SIZE),
+      make_corpus("mixed_frames", 1, 512, 16, READ_SIZE),
+      // Same mix, but every frame is split across several short reads.
+      make_corpus("split_reads", 1, 512, 16, 7),
+  };
+
+  printf("{\n  \"context\": {\"corpus_bytes\": %d, \"read_size\": %d},\n  \"benchmarks\": [", CORPUS_SIZE, READ_SIZE);
+  handler_out_t out = {0};
+  const char* sep = "";
+  for (int c = 0; c < NUM_CORPORA; c++) {
+    uint64_t expected_checksum = 0;
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+      // Every variant must produce exactly what the scalar one does.
+      uint64_t checksum = 0;
+      long long frames = scan_corpus(&variants[v], &corpora[c], &out, &checksum);
+      if (v == 0) {
+        expected_checksum = checksum;
+      } else if (checksum != expected_checksum) {
+        die("%s differs from %s on %s", variants[v].name, variants[0].name, corpora[c].name);
+      }
+
+      long long iterations = 0;
+      uint64_t t1 = monotonic_ns();
+      double elapsed;
+      do {
+        scan_corpus(&variants[v], &corpora[c], &out, &checksum);
+        iterations++;
+        elapsed = (monotonic_ns() - t1) / 1e9;
+      } while (elapsed < min_seconds);
+
+      printf("%s\n    {\"name\": \"echo_scan/%s/%s\", \"iterations\": %lld, \"real_time\": %.0f, \"time_unit\": \"ns\", "
+             "\"bytes_per_second\": %.0f, \"items_per_second\": %.0f}",
+             sep, variants[v].name, corpora[c].name, iterations, elapsed * 1e9 / iterations,
+             (double)corpora[c].len * iterations / elapsed, (double)frames * iterations / elapsed);
+      sep = ",";
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  handler_out_reset(&out);
+  for (int c = 0; c < NUM_CORPORA; c++) free(corpora[c].data);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coro.hpp"
+#include "handler.h"
+#include "utils.h"
+
+// coroutine-server.c with C++20 coroutines instead of fibers: serve_connection
+// keeps the blocking style, but each connection costs one heap frame (pooled,
+// see sv::frame_pool) rather than a fiber stack. Compare with uv-server.c's
+// callbacks and select-server.c's hand-written state machine.
+
+#define RECVBUF_SIZE 1024
+
+static sv::poll_reactor reactor;
+
+sv::task serve_connection(int sockfd, const handler_t* handler) {
+  handler_out_t out = {0};
+  // on_connect stages the greeting (e.g. "*" for echo), sent before reading.
+  void* conn = handler->on_connect(&out);
+
+  // Bytes received but not consumed by the handler yet.
+  uint8_t buf[RECVBUF_SIZE];
+  int pending = 0;
+
+  while (1) {
+    bool send_failed = false;
+    while (out.len > 0) {
+      const uint8_t* data;
+      int len = handler_out_peek(&out, &data);
+      int n = co_await sv::async_send(reactor, sockfd, data, len);
+      if (n == SOCKET_ERROR) {
+        send_failed = true;
+        break;
+      }
+      handler_out_consume(&out, n);
+      if (out.len == 0 && handler->on_writable) handler->on_writable(conn, &out);
+    }
+    if (send_failed) {
+      printf("[SERVE-CONNECTION] send failed (%d), closing\n", WSAGetLastError());
+      break;
+    }
+
+    if (pending == sizeof(buf)) {
+      printf("[SERVE-CONNECTION] frame exceeds %d bytes, closing\n", (int)sizeof(buf));
+      break;
+    }
+    int len = co_await sv::async_recv(reactor, sockfd, buf + pending, sizeof(buf) - pending);
+    if (len == SOCKET_ERROR) {
+      printf("[SERVE-CONNECTION] recv failed (%d), closing\n", WSAGetLastError());
+      break;
+    } else if (len == 0) {
+      break;
+    }
+
+    int consumed = handler->on_data(conn, buf, pending + len, &out);
+    if (consumed == HANDLER_CLOSE) {
+      break;
+    }
+    pending += len - consumed;
+    memmove(buf, buf + consumed, pending);
+  }
+  handler_out_reset(&out);
+  handler->on_close(conn);
+  closesocket(sockfd);
+}
+
+sv::task accept_connections(int listen_sockfd, const handler_t* handler) {
+  while (1) {
+    int sockfd = co_await sv::async_accept(reactor, listen_sockfd);
+    if (sockfd == SOCKET_ERROR) {
+      perror_die("accept");
+    }
+    make_socket_non_blocking(sockfd);
+    // Runs until its first wait, then comes back here.
+    serve_connection(sockfd, handler);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (initializeWinsock() != 0) {
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  const handler_t* handler = handler_from_env();
+  printf("Serving %s on port %d\n", handler->name, portnum);
+
+  int listen_sockfd = listen_inet_socket(portnum);
+  make_socket_non_blocking(listen_sockfd);
+
+  accept_connections(listen_sockfd, handler);
+  reactor.run();
+
+  cleanupWinsock();
+  return 0;
+}
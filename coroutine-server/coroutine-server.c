@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handler.h"
+#include "utils.h"
+
+// Stackful coroutine model: every connection runs serve_connection(), written
+// in the blocking style of sequential-server.c, on a fiber of its own. When
+// recv or send would block, the fiber switches back to the scheduler, which
+// polls every waiting socket at once with WSAPoll and resumes the fibers whose
+// sockets are ready. One thread serves as many connections as select-server,
+// with the control flow of sequential-server.
+//
+// Fibers are pooled: one that finished its connection parks and serves the
+// next one, so stacks are allocated only when concurrency peaks. Stacks are
+// small (STACK_SIZE_KB, 64 by default): handlers only keep their receive
+// buffer on them.
+
+#define RECVBUF_SIZE 1024
+
+typedef struct coroutine {
+  void* fiber;
+  // Connection being served, -1 while parked in the pool.
+  int sockfd;
+  // POLLRDNORM or POLLWRNORM while waiting for sockfd.
+  short waiting_for;
+  struct coroutine* next_parked;
+} coroutine_t;
+
+const handler_t* handler;
+
+// The fiber running the scheduler, and the coroutine it has resumed.
+void* scheduler_fiber;
+coroutine_t* current;
+
+// Coroutines waiting for their socket, in the order they started waiting.
+coroutine_t** waiting;
+int num_waiting;
+int max_waiting;
+
+coroutine_t* parked;
+
+// Suspends the current coroutine until its socket is ready for events.
+void wait_for(short events) {
+  if (num_waiting == max_waiting) {
+    max_waiting *= 2;
+    waiting = (coroutine_t**)realloc(waiting, sizeof(coroutine_t*) * max_waiting);
+    if (!waiting) {
+      die("out of memory growing to %d coroutines", max_waiting);
+    }
+  }
+  current->waiting_for = events;
+  waiting[num_waiting++] = current;
+  SwitchToFiber(scheduler_fiber);
+}
+
+// recv on a non-blocking socket that suspends the coroutine instead of
+// blocking; same results as a blocking recv.
+int co_recv(int sockfd, void* buf, int len) {
+  while (1) {
+    int n = recv(sockfd, (char*)buf, len, 0);
+    if (n != SOCKET_ERROR || WSAGetLastError() != WSAEWOULDBLOCK) {
+      return n;
+    }
+    wait_for(POLLRDNORM);
+  }
+}
+
+// handler_out_send_all on a non-blocking socket, suspending the coroutine
+// while the socket buffer is full.
+int co_send_all(int sockfd, handler_out_t* out) {
+  while (out->len > 0) {
+    const uint8_t* data;
+    int len = handler_out_peek(out, &data);
+    int n = send(sockfd, (const char*)data, len, 0);
+    if (n == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSAEWOULDBLOCK) {
+        return SOCKET_ERROR;
+      }
+      wait_for(POLLWRNORM);
+      continue;
+    }
+    handler_out_consume(out, n);
+  }
+  return 0;
+}
+
+// sequential-server.c's serve_connection, with co_recv and co_send_all.
+void serve_connection(int sockfd, const handler_t* handler) {
+  handler_out_t out = {0};
+  // on_connect stages the greeting (e.g. "*" for echo), sent before reading.
+  void* conn = handler->on_connect(&out);
+
+  // Bytes received but not consumed by the handler yet.
+  uint8_t buf[RECVBUF_SIZE];
+  int pending = 0;
+
+  while (1) {
+    if (out.len > 0) {
+      if (co_send_all(sockfd, &out) == SOCKET_ERROR) {
+        printf("[SERVE-CONNECTION] send failed (%d), closing\n", WSAGetLastError());
+        break;
+      }
+      if (handler->on_writable) {
+        handler->on_writable(conn, &out);
+        continue;
+      }
+    }
+
+    if (pending == sizeof(buf)) {
+      printf("[SERVE-CONNECTION] frame exceeds %d bytes, closing\n", (int)sizeof(buf));
+      break;
+    }
+    int len = co_recv(sockfd, buf + pending, sizeof(buf) - pending);
+    if (len == SOCKET_ERROR) {
+      printf("[SERVE-CONNECTION] recv failed (%d), closing\n", WSAGetLastError());
+      break;
+    } else if (len == 0)
+      break;
+
+    int consumed = handler->on_data(conn, buf, pending + len, &out);
+    if (consumed == HANDLER_CLOSE) {
+      break;
+    }
+    pending += len - consumed;
+    memmove(buf, buf + consumed, pending);
+  }
+  handler_out_reset(&out);
+  handler->on_close(conn);
+  closesocket(sockfd);
+}
+
+void CALLBACK coroutine_main(void* arg) {
+  coroutine_t* self = (coroutine_t*)arg;
+  while (1) {
+    serve_connection(self->sockfd, handler);
+    // Park; the scheduler resumes us with the next connection.
+    self->sockfd = -1;
+    SwitchToFiber(scheduler_fiber);
+  }
+}
+
+// Runs coroutine until it waits or finishes its connection.
+void resume(coroutine_t* coroutine) {
+  current = coroutine;
+  SwitchToFiber(coroutine->fiber);
+  current = NULL;
+  if (coroutine->sockfd == -1) {
+    coroutine->next_parked = parked;
+    parked = coroutine;
+  }
+}
+
+// Serves sockfd on a parked coroutine, or on a new one.
+void start_coroutine(int sockfd, size_t stack_size) {
+  coroutine_t* coroutine = parked;
+  if (coroutine) {
+    parked = coroutine->next_parked;
+  } else {
+    coroutine = (coroutine_t*)xmalloc(sizeof(*coroutine));
+    // Commit a single page up front; the rest of the stack is only reserved.
+    coroutine->fiber = CreateFiberEx(4096, stack_size, 0, coroutine_main, coroutine);
+    if (!coroutine->fiber) {
+      die("CreateFiberEx failed: %lu", GetLastError());
+    }
+  }
+  coroutine->sockfd = sockfd;
+  resume(coroutine);
+}
+
+int main(int argc, char** argv) {
+  if (initializeWinsock() != 0) {
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  handler = handler_from_env();
+  size_t stack_size = (size_t)getenv_int("STACK_SIZE_KB", 64) * 1024;
+  printf("Serving %s on port %d, %d KiB coroutine stacks\n", handler->name, portnum, (int)(stack_size / 1024));
+
+  int server_sockfd = listen_inet_socket(portnum);
+  make_socket_non_blocking(server_sockfd);
+
+  scheduler_fiber = ConvertThreadToFiber(NULL);
+  if (!scheduler_fiber) {
+    die("ConvertThreadToFiber failed: %lu", GetLastError());
+  }
+
+  max_waiting = 64;
+  waiting = (coroutine_t**)xmalloc(sizeof(coroutine_t*) * max_waiting);
+  num_waiting = 0;
+  // Sized with waiting; pollfds[0] is the listener.
+  WSAPOLLFD* pollfds = NULL;
+  coroutine_t** ready = NULL;
+  int pollfds_size = 0;
+
+  while (1) {
+    if (pollfds_size < max_waiting) {
+      pollfds_size = max_waiting;
+      pollfds = (WSAPOLLFD*)realloc(pollfds, sizeof(WSAPOLLFD) * (pollfds_size + 1));
+      ready = (coroutine_t**)realloc(ready, sizeof(coroutine_t*) * pollfds_size);
+      if (!pollfds || !ready) {
+        die("out of memory growing to %d coroutines", pollfds_size);
+      }
+    }
+    pollfds[0].fd = server_sockfd;
+    pollfds[0].events = POLLRDNORM;
+    for (int i = 0; i < num_waiting; i++) {
+      pollfds[i + 1].fd = waiting[i]->sockfd;
+      pollfds[i + 1].events = waiting[i]->waiting_for;
+    }
+
+    if (WSAPoll(pollfds, num_waiting + 1, -1) == SOCKET_ERROR) {
+      perror_die("[SCHEDULER] WSAPoll error");
+    }
+
+    // Split the ready coroutines off before resuming any: resumed ones append
+    // to waiting again.
+    int num_ready = 0;
+    int still_waiting = 0;
+    for (int i = 0; i < num_waiting; i++) {
+      // Errors and hangups resume the coroutine too; its recv or send reports
+      // them.
+      if (pollfds[i + 1].revents) {
+        ready[num_ready++] = waiting[i];
+      } else {
+        waiting[still_waiting++] = waiting[i];
+      }
+    }
+    num_waiting = still_waiting;
+    for (int i = 0; i < num_ready; i++) {
+      resume(ready[i]);
+    }
+
+    if (pollfds[0].revents & POLLRDNORM) {
+      int client_sockfd = accept(server_sockfd, NULL, NULL);
+      if (client_sockfd == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+          perror_die("accept");
+        }
+      } else {
+        make_socket_non_blocking(client_sockfd);
+        start_coroutine(client_sockfd, stack_size);
+      }
+    }
+  }
+
+  cleanupWinsock();
+  return 0;
+}
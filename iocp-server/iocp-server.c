@@ -0,0 +1,495 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <winsock2.h>
+#include <mswsock.h>
+
+#include "handler.h"
+#include "utils.h"
+
+// Completion-based model: instead of waiting for readiness and then calling
+// recv/send (two or more syscalls per message, as in select-server and the uv
+// servers), every connection always has one overlapped WSARecv or WSASend
+// posted, and the loop is told when it has completed, data already in place.
+//
+// Each loop thread owns an I/O completion port and the connections on it, and
+// takes up to IOCP_BATCH completions per GetQueuedCompletionStatusEx call.
+// Sockets are put in FILE_SKIP_COMPLETION_PORT_ON_SUCCESS mode, so an
+// operation that can complete at once does so inside WSARecv/WSASend and is
+// handled there and then, without a trip through the port. On a loaded loop
+// most messages thus cost a single call, and the wait is shared by a batch.
+//
+// Loop 0 also keeps ACCEPTS_POSTED AcceptEx calls outstanding on the listener
+// (a listening socket can only be tied to one port) and deals the accepted
+// sockets out to the loops in turn.
+//
+// PROFILE=LOW_LATENCY is tuned for many mostly idle connections:
+// - An idle connection waits with a zero-byte WSARecv and holds no receive
+//   buffer. A buffer is taken from the loop's pool when the read completes
+//   and given back once the handler has consumed everything. The real
+//   WSARecv then completes inline, so the cost is one extra call per
+//   message.
+// - The loop spins on the port for SPIN_US microseconds (default 50) before
+//   going to sleep, so a busy loop answers without a thread wakeup.
+
+#define RECVBUF_SIZE 1024
+
+// Receive buffers allocated at once when a loop's pool runs dry.
+#define RECV_SLAB_BUFFERS 64
+
+// Completions taken per GetQueuedCompletionStatusEx call.
+#define IOCP_BATCH 64
+
+// Operations a connection may complete inline in a row before it's sent to
+// the back of the port's queue, so that a peer whose I/O keeps completing at
+// once can't hold the loop and starve the others.
+#define MAX_INLINE_COMPLETIONS IOCP_BATCH
+
+// AcceptEx calls kept posted, so that connections arriving together are
+// accepted without waiting for the loop to re-post.
+#define ACCEPTS_POSTED 16
+
+// Staged output chunks gathered into one WSASend.
+#define MAX_SEND_BUFS 16
+
+// Room AcceptEx needs for each of the two addresses it stores.
+#define ACCEPT_ADDR_SIZE (sizeof(struct sockaddr_in) + 16)
+
+// Completion keys.
+#define KEY_LISTENER 1
+#define KEY_PEER 2
+// A socket dealt out by loop 0, in dwNumberOfBytesTransferred.
+#define KEY_HANDOFF 3
+// A connection that used up its inline completions, with nothing in flight.
+#define KEY_RESUME 4
+
+typedef enum {
+    OP_RECV,
+    OP_SEND,
+    // A zero-byte WSARecv, completing once there's something to receive.
+    OP_WAIT,
+} op_t;
+
+typedef enum { IO_DONE, IO_PENDING, IO_FAILED } io_result_t;
+
+// A receive buffer, or a link in the loop's pool of them.
+typedef union recv_buffer {
+    union recv_buffer* next_free;
+    uint8_t data[RECVBUF_SIZE];
+} recv_buffer_t;
+
+typedef struct connection {
+    // First, so that a completion's OVERLAPPED* is the connection.
+    OVERLAPPED overlapped;
+    int sockfd;
+    // The operation in flight. A connection sends everything staged before
+    // it receives again, so there's only ever one.
+    op_t op;
+    // The socket is in FILE_SKIP_COMPLETION_PORT_ON_SUCCESS mode.
+    bool skips_port;
+    // Protocol state owned by the handler.
+    void* conn;
+    handler_out_t out;
+    // Bytes received but not yet consumed by the handler. NULL while the
+    // connection is parked (see park_idle).
+    recv_buffer_t* recvbuf;
+    int recvbuf_end;
+    // An OP_WAIT completed: the next receive won't wait.
+    bool readable;
+    // Next free entry while on the loop's free list.
+    struct connection* next_free;
+} connection_t;
+
+typedef struct {
+    // First, so that a completion's OVERLAPPED* is the accept_op_t.
+    OVERLAPPED overlapped;
+    // Created beforehand; becomes the connection when AcceptEx completes.
+    int sockfd;
+    uint8_t addrs[2 * ACCEPT_ADDR_SIZE];
+} accept_op_t;
+
+typedef struct {
+    int index;
+    HANDLE port;
+    // Closed connections, kept for the next accept.
+    connection_t* free_connections;
+    // Receive buffers not attached to a connection.
+    recv_buffer_t* free_buffers;
+    int buffers_allocated;
+    int buffers_attached;
+    // Since the last stats report.
+    uint64_t waits;
+    uint64_t completions;
+    uint64_t inline_completions;
+    uint64_t last_report_ns;
+} io_loop_t;
+
+const handler_t* handler;
+
+io_loop_t* loops;
+int num_loops;
+
+int listen_sockfd;
+LPFN_ACCEPTEX accept_ex;
+
+// Loop 0 only: who gets the next accepted socket.
+int next_loop;
+
+// STATS_INTERVAL_MS; 0 for no stats.
+int stats_interval_ms;
+
+// Set by PROFILE=LOW_LATENCY: idle connections wait with a zero-byte read
+// and no receive buffer.
+bool park_idle;
+
+// How long a loop polls its port before blocking on it.
+int spin_us;
+
+static void post_accept(accept_op_t* op) {
+    op->sockfd = (int)WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+    if (op->sockfd == (int)INVALID_SOCKET) {
+        perror_die("WSASocket");
+    }
+    memset(&op->overlapped, 0, sizeof(op->overlapped));
+    DWORD bytes;
+    if (!accept_ex(listen_sockfd, op->sockfd, op->addrs, 0, ACCEPT_ADDR_SIZE, ACCEPT_ADDR_SIZE, &bytes,
+                   &op->overlapped) &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        perror_die("AcceptEx");
+    }
+}
+
+static void on_accepted(accept_op_t* op, bool ok) {
+    if (!ok) {
+        // The peer gave up before the accept completed.
+        closesocket(op->sockfd);
+    } else {
+        // Lets getpeername, shutdown and the like work on the socket.
+        setsockopt(op->sockfd, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (const char*)&listen_sockfd,
+                   sizeof(listen_sockfd));
+        io_loop_t* loop = &loops[next_loop];
+        next_loop = (next_loop + 1) % num_loops;
+        if (!CreateIoCompletionPort((HANDLE)(ULONG_PTR)op->sockfd, loop->port, KEY_PEER, 0)) {
+            die("CreateIoCompletionPort failed: %lu", GetLastError());
+        }
+        PostQueuedCompletionStatus(loop->port, (DWORD)op->sockfd, KEY_HANDOFF, NULL);
+    }
+    post_accept(op);
+}
+
+static void attach_recvbuf(io_loop_t* loop, connection_t* c) {
+    if (!loop->free_buffers) {
+        recv_buffer_t* slab = (recv_buffer_t*)xmalloc(sizeof(recv_buffer_t) * RECV_SLAB_BUFFERS);
+        for (int i = 0; i < RECV_SLAB_BUFFERS; i++) {
+            slab[i].next_free = loop->free_buffers;
+            loop->free_buffers = &slab[i];
+        }
+        loop->buffers_allocated += RECV_SLAB_BUFFERS;
+    }
+    c->recvbuf = loop->free_buffers;
+    loop->free_buffers = c->recvbuf->next_free;
+    loop->buffers_attached++;
+}
+
+static void detach_recvbuf(io_loop_t* loop, connection_t* c) {
+    c->recvbuf->next_free = loop->free_buffers;
+    loop->free_buffers = c->recvbuf;
+    c->recvbuf = NULL;
+    loop->buffers_attached--;
+}
+
+static void close_connection(io_loop_t* loop, connection_t* c) {
+    if (c->recvbuf) {
+        detach_recvbuf(loop, c);
+    }
+    handler_out_reset(&c->out);
+    handler->on_close(c->conn);
+    closesocket(c->sockfd);
+    c->next_free = loop->free_connections;
+    loop->free_connections = c;
+}
+
+// Posts the connection's next operation: a send of everything staged, if
+// anything is, and a receive otherwise. IO_DONE means it has already
+// completed, with *bytes transferred, and the port won't report it.
+static io_result_t start_op(io_loop_t* loop, connection_t* c, DWORD* bytes) {
+    memset(&c->overlapped, 0, sizeof(c->overlapped));
+    int rc;
+    if (c->out.len > 0) {
+        c->op = OP_SEND;
+        WSABUF bufs[MAX_SEND_BUFS];
+        int num_bufs = 0;
+        for (sendbuf_chunk_t* chunk = c->out.head; chunk && num_bufs < MAX_SEND_BUFS; chunk = chunk->next) {
+            bufs[num_bufs].buf = (char*)&chunk->data[chunk->start];
+            bufs[num_bufs].len = chunk->end - chunk->start;
+            num_bufs++;
+        }
+        rc = WSASend(c->sockfd, bufs, num_bufs, bytes, 0, &c->overlapped, NULL);
+    } else if (park_idle && !c->readable && c->recvbuf_end == 0) {
+        // Nothing is half-received, so the buffer can go back to the pool
+        // until the peer sends more.
+        if (c->recvbuf) {
+            detach_recvbuf(loop, c);
+        }
+        c->op = OP_WAIT;
+        WSABUF empty = {0, NULL};
+        DWORD flags = 0;
+        rc = WSARecv(c->sockfd, &empty, 1, bytes, &flags, &c->overlapped, NULL);
+    } else {
+        if (c->recvbuf_end == RECVBUF_SIZE) {
+            // A frame exceeding RECVBUF_SIZE.
+            return IO_FAILED;
+        }
+        if (!c->recvbuf) {
+            attach_recvbuf(loop, c);
+        }
+        c->readable = false;
+        c->op = OP_RECV;
+        WSABUF buf = {RECVBUF_SIZE - c->recvbuf_end, (char*)&c->recvbuf->data[c->recvbuf_end]};
+        DWORD flags = 0;
+        rc = WSARecv(c->sockfd, &buf, 1, bytes, &flags, &c->overlapped, NULL);
+    }
+
+    if (rc == 0) {
+        return c->skips_port ? IO_DONE : IO_PENDING;
+    }
+    return WSAGetLastError() == WSA_IO_PENDING ? IO_PENDING : IO_FAILED;
+}
+
+// Takes in the result of the connection's completed operation. Returns false
+// when the connection should be closed.
+static bool finish_op(connection_t* c, DWORD bytes) {
+    if (c->op == OP_WAIT) {
+        c->readable = true;
+        return true;
+    }
+    if (c->op == OP_SEND) {
+        handler_out_consume(&c->out, bytes);
+        // The handler may stage more output once the previous batch is out.
+        if (c->out.len == 0 && handler->on_writable) {
+            handler->on_writable(c->conn, &c->out);
+        }
+        return true;
+    }
+
+    if (bytes == 0) {
+        return false;
+    }
+    c->recvbuf_end += bytes;
+    int consumed = handler->on_data(c->conn, c->recvbuf->data, c->recvbuf_end, &c->out);
+    if (consumed == HANDLER_CLOSE) {
+        return false;
+    }
+    c->recvbuf_end -= consumed;
+    memmove(c->recvbuf->data, &c->recvbuf->data[consumed], c->recvbuf_end);
+    return true;
+}
+
+// Posts operations for the connection, handling those that complete at once,
+// until one is left in flight, the connection is closed or it has had
+// MAX_INLINE_COMPLETIONS; then it's queued behind the completions waiting on
+// the port and carries on from there.
+static void run_connection(io_loop_t* loop, connection_t* c) {
+    for (int num_inline = 0;; num_inline++) {
+        if (num_inline == MAX_INLINE_COMPLETIONS) {
+            // Not KEY_PEER: that would take the last inline completion's
+            // result off the OVERLAPPED again.
+            PostQueuedCompletionStatus(loop->port, 0, KEY_RESUME, &c->overlapped);
+            return;
+        }
+        DWORD bytes = 0;
+        io_result_t result = start_op(loop, c, &bytes);
+        if (result == IO_PENDING) {
+            return;
+        }
+        if (result == IO_FAILED || !finish_op(c, bytes)) {
+            close_connection(loop, c);
+            return;
+        }
+        loop->inline_completions++;
+    }
+}
+
+static void start_connection(io_loop_t* loop, int sockfd) {
+    connection_t* c = loop->free_connections;
+    if (c) {
+        loop->free_connections = c->next_free;
+    } else {
+        c = (connection_t*)xmalloc(sizeof(*c));
+    }
+    c->sockfd = sockfd;
+    c->skips_port = SetFileCompletionNotificationModes(
+        (HANDLE)(ULONG_PTR)sockfd, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+    c->out = (handler_out_t){0};
+    c->recvbuf = NULL;
+    c->recvbuf_end = 0;
+    c->readable = false;
+    if (!park_idle) {
+        attach_recvbuf(loop, c);
+    }
+    c->conn = handler->on_connect(&c->out);
+    run_connection(loop, c);
+}
+
+static void report_stats(io_loop_t* loop) {
+    uint64_t now = monotonic_ns();
+    if (now - loop->last_report_ns < (uint64_t)stats_interval_ms * 1000000) {
+        return;
+    }
+    printf("[LOOP %d] %llu completions in %llu waits (%.1f per wait), %llu more completed inline, "
+           "%d of %d receive buffers attached\n",
+           loop->index, (unsigned long long)loop->completions, (unsigned long long)loop->waits,
+           loop->waits ? (double)loop->completions / loop->waits : 0.0, (unsigned long long)loop->inline_completions,
+           loop->buffers_attached, loop->buffers_allocated);
+    loop->waits = 0;
+    loop->completions = 0;
+    loop->inline_completions = 0;
+    loop->last_report_ns = now;
+}
+
+// Takes the next batch of completions off the loop's port, polling it for up
+// to spin_us before blocking.
+static ULONG wait_for_completions(io_loop_t* loop, OVERLAPPED_ENTRY* completions) {
+    ULONG num_completions;
+    if (spin_us > 0) {
+        uint64_t deadline = monotonic_ns() + (uint64_t)spin_us * 1000;
+        do {
+            if (GetQueuedCompletionStatusEx(loop->port, completions, IOCP_BATCH, &num_completions, 0, FALSE)) {
+                return num_completions;
+            }
+            if (GetLastError() != WAIT_TIMEOUT) {
+                die("[LOOP %d] GetQueuedCompletionStatusEx failed: %lu", loop->index, GetLastError());
+            }
+        } while (monotonic_ns() < deadline);
+    }
+    if (!GetQueuedCompletionStatusEx(loop->port, completions, IOCP_BATCH, &num_completions, INFINITE, FALSE)) {
+        die("[LOOP %d] GetQueuedCompletionStatusEx failed: %lu", loop->index, GetLastError());
+    }
+    return num_completions;
+}
+
+static void* run_loop(void* arg) {
+    io_loop_t* loop = (io_loop_t*)arg;
+    handler_out_use_thread_pool();
+    loop->last_report_ns = monotonic_ns();
+
+    OVERLAPPED_ENTRY completions[IOCP_BATCH];
+    while (1) {
+        ULONG num_completions = wait_for_completions(loop, completions);
+        loop->waits++;
+        loop->completions += num_completions;
+
+        for (ULONG i = 0; i < num_completions; i++) {
+            OVERLAPPED_ENTRY* completion = &completions[i];
+            switch (completion->lpCompletionKey) {
+                case KEY_HANDOFF:
+                    start_connection(loop, (int)completion->dwNumberOfBytesTransferred);
+                    break;
+                case KEY_LISTENER: {
+                    accept_op_t* op = (accept_op_t*)completion->lpOverlapped;
+                    DWORD bytes, flags;
+                    on_accepted(op, WSAGetOverlappedResult(listen_sockfd, &op->overlapped, &bytes, FALSE, &flags));
+                    break;
+                }
+                case KEY_RESUME:
+                    run_connection(loop, (connection_t*)completion->lpOverlapped);
+                    break;
+                case KEY_PEER: {
+                    connection_t* c = (connection_t*)completion->lpOverlapped;
+                    DWORD bytes, flags;
+                    if (!WSAGetOverlappedResult(c->sockfd, &c->overlapped, &bytes, FALSE, &flags) ||
+                        !finish_op(c, bytes)) {
+                        close_connection(loop, c);
+                    } else {
+                        run_connection(loop, c);
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (stats_interval_ms > 0) {
+            report_stats(loop);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (initializeWinsock() != 0) {
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    handler = handler_from_env();
+
+    // LOOPS overrides the number of loops, one per processor by default.
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    num_loops = getenv_int("LOOPS", (int)system_info.dwNumberOfProcessors);
+    if (num_loops < 1) {
+        die("LOOPS must be at least 1 (got %d)", num_loops);
+    }
+    stats_interval_ms = getenv_int("STATS_INTERVAL_MS", 0);
+
+    char* profile = getenv("PROFILE");
+    if (profile && !strcmp(profile, "LOW_LATENCY")) {
+        park_idle = true;
+        spin_us = getenv_int("SPIN_US", 50);
+    } else if (!profile || !strcmp(profile, "DEFAULT")) {
+        spin_us = getenv_int("SPIN_US", 0);
+    } else {
+        die("unknown PROFILE: %s", profile);
+    }
+    printf("Serving %s on port %d with %d loops%s\n", handler->name, portnum, num_loops,
+           park_idle ? ", low-latency profile" : "");
+
+    listen_sockfd = listen_inet_socket(portnum);
+    printf("server sockfd: %d\n", listen_sockfd);
+
+    GUID accept_ex_guid = WSAID_ACCEPTEX;
+    DWORD bytes;
+    if (WSAIoctl(listen_sockfd, SIO_GET_EXTENSION_FUNCTION_POINTER, &accept_ex_guid, sizeof(accept_ex_guid),
+                 &accept_ex, sizeof(accept_ex), &bytes, NULL, NULL) == SOCKET_ERROR) {
+        perror_die("WSAIoctl(AcceptEx)");
+    }
+
+    loops = (io_loop_t*)xmalloc(sizeof(io_loop_t) * num_loops);
+    memset(loops, 0, sizeof(io_loop_t) * num_loops);
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].index = i;
+        loops[i].port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (!loops[i].port) {
+            die("CreateIoCompletionPort failed: %lu", GetLastError());
+        }
+    }
+
+    if (!CreateIoCompletionPort((HANDLE)(ULONG_PTR)listen_sockfd, loops[0].port, KEY_LISTENER, 0)) {
+        die("CreateIoCompletionPort failed for the server socket: %lu", GetLastError());
+    }
+    accept_op_t* accepts = (accept_op_t*)xmalloc(sizeof(accept_op_t) * ACCEPTS_POSTED);
+    for (int i = 0; i < ACCEPTS_POSTED; i++) {
+        post_accept(&accepts[i]);
+    }
+
+    for (int i = 1; i < num_loops; i++) {
+        pthread_t the_thread;
+        if (pthread_create(&the_thread, NULL, run_loop, &loops[i]) != 0) {
+            die("pthread_create failed for loop %d", i);
+        }
+        pthread_detach(the_thread);
+    }
+    // Loop 0 runs on the main thread and never returns.
+    run_loop(&loops[0]);
+
+    cleanupWinsock();
+    return 0;
+}
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handler.h"
+#include "utils.h"
+
+// Thread-per-core model: every core runs the select-server loop on its own
+// thread, over WSAPoll instead of select so it isn't capped at FD_SETSIZE.
+// Each loop owns its connection table, receive buffers and output chunk pool;
+// loops share nothing but the listening socket and never hand connections to
+// each other.
+//
+// Winsock has no SO_REUSEPORT, so instead of one listener per loop all loops
+// poll the same non-blocking listener and race to accept. A loop that's busy
+// polls less often and so picks up fewer new connections.
+
+#define RECVBUF_SIZE 1024
+
+// Connections a loop has room for before its table grows.
+#define INITIAL_PEERS 64
+
+typedef struct peer_state {
+    int sockfd;
+    // Protocol state owned by the handler.
+    void* conn;
+    handler_out_t out;
+    // Bytes received but not yet consumed by the handler.
+    uint8_t recvbuf[RECVBUF_SIZE];
+    int recvbuf_end;
+    // Next free entry while on the loop's free list.
+    struct peer_state* next_free;
+} peer_state_t;
+
+// Everything one loop owns.
+typedef struct {
+    int index;
+    // Pin the loop's thread to processor index.
+    bool pinned;
+    int listen_sockfd;
+    // pollfds[0] is the listener; pollfds[i + 1] belongs to peers[i].
+    WSAPOLLFD* pollfds;
+    peer_state_t** peers;
+    int num_peers;
+    int max_peers;
+    // Closed peers, kept with their buffers for the next accept.
+    peer_state_t* free_peers;
+} core_loop_t;
+
+const handler_t* handler;
+
+static peer_state_t* alloc_peer(core_loop_t* loop) {
+    peer_state_t* peer = loop->free_peers;
+    if (peer) {
+        loop->free_peers = peer->next_free;
+    } else {
+        peer = (peer_state_t*)xmalloc(sizeof(*peer));
+    }
+    return peer;
+}
+
+static void add_peer(core_loop_t* loop, int client_sockfd) {
+    if (loop->num_peers == loop->max_peers) {
+        loop->max_peers *= 2;
+        loop->pollfds = (WSAPOLLFD*)realloc(loop->pollfds, sizeof(WSAPOLLFD) * (loop->max_peers + 1));
+        loop->peers = (peer_state_t**)realloc(loop->peers, sizeof(peer_state_t*) * loop->max_peers);
+        if (!loop->pollfds || !loop->peers) {
+            die("[LOOP %d] out of memory growing to %d peers", loop->index, loop->max_peers);
+        }
+    }
+
+    peer_state_t* peer = alloc_peer(loop);
+    peer->sockfd = client_sockfd;
+    peer->out = (handler_out_t){0};
+    peer->recvbuf_end = 0;
+    peer->conn = handler->on_connect(&peer->out);
+
+    int i = loop->num_peers++;
+    loop->peers[i] = peer;
+    loop->pollfds[i + 1].fd = client_sockfd;
+    loop->pollfds[i + 1].events = peer->out.len > 0 ? POLLWRNORM : POLLRDNORM;
+    loop->pollfds[i + 1].revents = 0;
+}
+
+// Closes peers[i] and moves the last peer into its slot.
+static void remove_peer(core_loop_t* loop, int i) {
+    peer_state_t* peer = loop->peers[i];
+    handler_out_reset(&peer->out);
+    handler->on_close(peer->conn);
+    closesocket(peer->sockfd);
+    peer->next_free = loop->free_peers;
+    loop->free_peers = peer;
+
+    int last = --loop->num_peers;
+    loop->peers[i] = loop->peers[last];
+    loop->pollfds[i + 1] = loop->pollfds[last + 1];
+}
+
+// The on_peer_* callbacks of select-server.c, minus the logging. They return
+// the events to wait for next: POLLRDNORM, POLLWRNORM, or 0 to close.
+static short on_peer_received(peer_state_t* peer) {
+    if (peer->out.len > 0) {
+        return POLLWRNORM;
+    }
+    if (peer->recvbuf_end == RECVBUF_SIZE) {
+        return 0;
+    }
+
+    int bytesRecv = recv(peer->sockfd, (char*)&peer->recvbuf[peer->recvbuf_end], RECVBUF_SIZE - peer->recvbuf_end, 0);
+    if (bytesRecv == 0) {
+        return 0;
+    } else if (bytesRecv == SOCKET_ERROR) {
+        // Unlike select-server a failing peer only takes itself down; the loop
+        // carries the other connections of this core.
+        return WSAGetLastError() == WSAEWOULDBLOCK ? POLLRDNORM : 0;
+    }
+
+    peer->recvbuf_end += bytesRecv;
+    int consumed = handler->on_data(peer->conn, peer->recvbuf, peer->recvbuf_end, &peer->out);
+    if (consumed == HANDLER_CLOSE) {
+        return 0;
+    }
+    peer->recvbuf_end -= consumed;
+    memmove(peer->recvbuf, &peer->recvbuf[consumed], peer->recvbuf_end);
+
+    return peer->out.len > 0 ? POLLWRNORM : POLLRDNORM;
+}
+
+static short on_peer_sent(peer_state_t* peer) {
+    while (peer->out.len > 0) {
+        const uint8_t* data;
+        int msg_len = handler_out_peek(&peer->out, &data);
+        int bytes_sent = send(peer->sockfd, (const char*)data, msg_len, 0);
+        if (bytes_sent == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK ? POLLWRNORM : 0;
+        }
+        handler_out_consume(&peer->out, bytes_sent);
+        if (bytes_sent < msg_len) {
+            return POLLWRNORM;
+        }
+    }
+
+    if (handler->on_writable) {
+        handler->on_writable(peer->conn, &peer->out);
+        if (peer->out.len > 0) return POLLWRNORM;
+    }
+    return POLLRDNORM;
+}
+
+static void* run_loop(void* arg) {
+    core_loop_t* loop = (core_loop_t*)arg;
+    if (loop->pinned && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << loop->index)) {
+        printf("[LOOP %d] could not pin to processor %d\n", loop->index, loop->index);
+    }
+    handler_out_use_thread_pool();
+
+    loop->max_peers = INITIAL_PEERS;
+    loop->pollfds = (WSAPOLLFD*)xmalloc(sizeof(WSAPOLLFD) * (loop->max_peers + 1));
+    loop->peers = (peer_state_t**)xmalloc(sizeof(peer_state_t*) * loop->max_peers);
+    loop->num_peers = 0;
+    loop->free_peers = NULL;
+    loop->pollfds[0].fd = loop->listen_sockfd;
+    loop->pollfds[0].events = POLLRDNORM;
+
+    while (1) {
+        int num_ready = WSAPoll(loop->pollfds, loop->num_peers + 1, -1);
+        if (num_ready == SOCKET_ERROR) {
+            perror_die("[LOOP] WSAPoll error");
+        }
+
+        // Peers go first, from the end: remove_peer fills the hole with the
+        // last peer, which has already been handled.
+        for (int i = loop->num_peers - 1; i >= 0 && num_ready > 0; i--) {
+            WSAPOLLFD* pollfd = &loop->pollfds[i + 1];
+            if (!pollfd->revents) continue;
+            num_ready--;
+
+            short events;
+            if (pollfd->revents & POLLWRNORM) {
+                events = on_peer_sent(loop->peers[i]);
+            } else if (pollfd->revents & POLLRDNORM) {
+                events = on_peer_received(loop->peers[i]);
+            } else {
+                // POLLHUP, POLLERR or POLLNVAL without anything left to read.
+                events = 0;
+            }
+            if (events) {
+                pollfd->events = events;
+            } else {
+                remove_peer(loop, i);
+            }
+        }
+
+        if (loop->pollfds[0].revents & POLLRDNORM) {
+            int client_sockfd = accept(loop->listen_sockfd, NULL, NULL);
+            if (client_sockfd == SOCKET_ERROR) {
+                // Another loop won the race for this connection.
+                if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                    perror_die("accept");
+                }
+            } else {
+                make_socket_non_blocking(client_sockfd);
+                add_peer(loop, client_sockfd);
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (initializeWinsock() != 0) {
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    handler = handler_from_env();
+
+    // LOOPS overrides the number of loops, one per processor by default. Loop
+    // i is pinned to processor i unless PIN_LOOPS=0.
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    int num_loops = getenv_int("LOOPS", (int)system_info.dwNumberOfProcessors);
+    bool pin_loops = getenv_int("PIN_LOOPS", 1) && num_loops <= (int)system_info.dwNumberOfProcessors &&
+                     num_loops <= (int)sizeof(DWORD_PTR) * 8;
+    if (num_loops < 1) {
+        die("LOOPS must be at least 1 (got %d)", num_loops);
+    }
+    printf("Serving %s on port %d with %d loops\n", handler->name, portnum, num_loops);
+
+    int server_sockfd = listen_inet_socket(portnum);
+    make_socket_non_blocking(server_sockfd);
+    printf("server sockfd: %d\n", server_sockfd);
+
+    core_loop_t* loops = (core_loop_t*)xmalloc(sizeof(core_loop_t) * num_loops);
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].index = i;
+        loops[i].pinned = pin_loops;
+        loops[i].listen_sockfd = server_sockfd;
+    }
+    for (int i = 1; i < num_loops; i++) {
+        pthread_t the_thread;
+        if (pthread_create(&the_thread, NULL, run_loop, &loops[i]) != 0) {
+            die("pthread_create failed for loop %d", i);
+        }
+        pthread_detach(the_thread);
+    }
+    // Loop 0 runs on the main thread and never returns.
+    run_loop(&loops[0]);
+
+    cleanupWinsock();
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Pre-fork model: this master opens the listening socket and keeps WORKERS
+// copies of a single-threaded server running on it, each in its own process.
+// The worker is any of the servers built on listen_inet_socket() (by default
+// sequential-server, see WORKER), run unchanged: with INHERITED_LISTENER set,
+// listen_inet_socket() picks up the master's socket instead of binding.
+//
+// Windows has no fork(), so workers are started with CreateProcess and get the
+// socket through WSADuplicateSocket, written to their stdin. A worker that
+// exits for any reason is restarted; the others keep serving meanwhile.
+
+// A worker dying sooner than this after its start is restarted only after the
+// same delay, so a worker that can't start doesn't spin the master.
+#define MIN_WORKER_LIFETIME_MS 1000
+
+typedef struct {
+  HANDLE process;
+  ULONGLONG started_at;
+} worker_t;
+
+// Starts command as a worker on listen_sockfd.
+worker_t spawn_worker(const char* command, int listen_sockfd) {
+  SECURITY_ATTRIBUTES inheritable = {sizeof(inheritable), NULL, TRUE};
+  HANDLE stdin_read, stdin_write;
+  if (!CreatePipe(&stdin_read, &stdin_write, &inheritable, 0)) {
+    die("CreatePipe failed: %lu", GetLastError());
+  }
+  // Only the read end goes to the worker.
+  SetHandleInformation(stdin_write, HANDLE_FLAG_INHERIT, 0);
+
+  STARTUPINFOA startup_info;
+  memset(&startup_info, 0, sizeof(startup_info));
+  startup_info.cb = sizeof(startup_info);
+  startup_info.dwFlags = STARTF_USESTDHANDLES;
+  startup_info.hStdInput = stdin_read;
+  startup_info.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+  startup_info.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+  // CreateProcess may modify the command line it's given.
+  char command_line[1024];
+  snprintf(command_line, sizeof(command_line), "%s", command);
+
+  PROCESS_INFORMATION process_info;
+  if (!CreateProcessA(NULL, command_line, NULL, NULL, TRUE, 0, NULL, NULL, &startup_info, &process_info)) {
+    die("CreateProcess(%s) failed: %lu", command, GetLastError());
+  }
+  CloseHandle(stdin_read);
+  CloseHandle(process_info.hThread);
+
+  WSAPROTOCOL_INFOA info;
+  if (WSADuplicateSocketA(listen_sockfd, process_info.dwProcessId, &info) != 0) {
+    die("WSADuplicateSocket failed: %d", WSAGetLastError());
+  }
+  DWORD written;
+  if (!WriteFile(stdin_write, &info, sizeof(info), &written, NULL) || written != sizeof(info)) {
+    // The worker died before reading it; the supervisor will notice.
+    printf("[MASTER] handing the listener to worker %lu failed\n", process_info.dwProcessId);
+  }
+  CloseHandle(stdin_write);
+
+  printf("[MASTER] started worker %lu\n", process_info.dwProcessId);
+  return (worker_t){process_info.hProcess, GetTickCount64()};
+}
+
+int main(int argc, char** argv) {
+  if (initializeWinsock() != 0) {
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  int num_workers = getenv_int("WORKERS", (int)system_info.dwNumberOfProcessors);
+  if (num_workers < 1 || num_workers > MAXIMUM_WAIT_OBJECTS) {
+    die("WORKERS must be between 1 and %d (got %d)", MAXIMUM_WAIT_OBJECTS, num_workers);
+  }
+  char* worker_program = getenv("WORKER");
+  char command[1024];
+  // The port is only for the worker's banner; it doesn't bind it.
+  snprintf(command, sizeof(command), "\"%s\" %d", worker_program ? worker_program : "sequential-server.exe", portnum);
+
+  int listen_sockfd = listen_inet_socket(portnum);
+  printf("[MASTER] listening on port %d, running %d x %s\n", portnum, num_workers, command);
+
+  // Workers inherit the environment (PROTOCOL, limits...) plus this.
+  SetEnvironmentVariableA("INHERITED_LISTENER", "1");
+
+  worker_t workers[MAXIMUM_WAIT_OBJECTS];
+  HANDLE processes[MAXIMUM_WAIT_OBJECTS];
+  for (int i = 0; i < num_workers; i++) {
+    workers[i] = spawn_worker(command, listen_sockfd);
+    processes[i] = workers[i].process;
+  }
+
+  // Supervise: restart whichever worker exits.
+  while (1) {
+    DWORD result = WaitForMultipleObjects(num_workers, processes, FALSE, INFINITE);
+    if (result == WAIT_FAILED) {
+      die("WaitForMultipleObjects failed: %lu", GetLastError());
+    }
+    int i = result - WAIT_OBJECT_0;
+    DWORD exit_code = 0;
+    GetExitCodeProcess(workers[i].process, &exit_code);
+    CloseHandle(workers[i].process);
+    printf("[MASTER] worker %d exited with %lu, restarting\n", i, exit_code);
+
+    if (GetTickCount64() - workers[i].started_at < MIN_WORKER_LIFETIME_MS) {
+      Sleep(MIN_WORKER_LIFETIME_MS);
+    }
+    workers[i] = spawn_worker(command, listen_sockfd);
+    processes[i] = workers[i].process;
+  }
+
+  cleanupWinsock();
+  return 0;
+}
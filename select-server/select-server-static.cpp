@@ -0,0 +1,42 @@
+#define FD_SETSIZE 1024
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handler.h"
+#include "reactor.hpp"
+#include "utils.h"
+
+// The select-server.c loop instantiated per handler type: for echo the
+// protocol is inlined into the read loop, any other PROTOCOL falls back to the
+// runtime handler_t through sv::dynamic_handler. MODE=DYNAMIC forces the
+// fallback for echo too, for comparison.
+static sv::select_reactor<sv::echo_static_handler<>> echo_reactor;
+static sv::select_reactor<sv::dynamic_handler> dynamic_reactor;
+
+int main(int argc, char** argv) {
+  if (initializeWinsock() != 0) {
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+
+  const handler_t* handler = handler_from_env();
+  const char* mode = getenv("MODE");
+  if (handler == &echo_handler && !(mode && !strcmp(mode, "DYNAMIC"))) {
+    printf("Serving static %s on port %d\n", sv::echo_static_handler<>::name, portnum);
+    echo_reactor.run(portnum);
+  } else {
+    printf("Serving dynamic %s on port %d\n", handler->name, portnum);
+    sv::dynamic_handler::vtable = handler;
+    dynamic_reactor.run(portnum);
+  }
+
+  cleanupWinsock();
+  return 0;
+}
@@ -1,31 +1,189 @@
 #include <stdbool.h>
 #include <stdint.h>
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
-#define FD_SETSIZE 1024
+
+#include "admission.h"
+#include "bufpool.h"
+#include "handler.h"
+#include "reactor.h"
 #include "utils.h"
 
-#define MAXFDs 1000
+#define RECVBUF_SIZE 1024
+
+// Defaults for BUDGET_BYTES and BUDGET_FRAMES.
+#define DEFAULT_BUDGET_BYTES (64 * 1024)
+#define DEFAULT_BUDGET_FRAMES 64
+
+// Defaults for OUTPUT_HIGH_WATERMARK and OUTPUT_LOW_WATERMARK.
+#define DEFAULT_OUTPUT_HIGH_WATERMARK (64 * 1024)
+#define DEFAULT_OUTPUT_LOW_WATERMARK (16 * 1024)
+
+// Slots added to the peer table at a time. Slots never move once added, so
+// that the timers linked through them stay put.
+#define PEER_PAGE_SLOTS 256
+
+// Receive buffers allocated at a time.
+#define RECVBUF_SLAB 64
+
+// A peer_id_t carries the slot index in its low PEER_INDEX_BITS bits. That's
+// as many sockets as a Windows process can have handles.
+#define PEER_INDEX_BITS 24
+#define MAX_PEERS (1 << PEER_INDEX_BITS)
 
 typedef enum {
-    INITIAL_ACK,
-    WAIT_FOR_MSG,
-    IN_MSG,
-} ProcessingState;
+    PEER_TIMEOUT_NONE,
+    PEER_TIMEOUT_IDLE,
+    PEER_TIMEOUT_READ,
+    PEER_TIMEOUT_WRITE,
+} peer_timeout_t;
 
-#define SENDBUF_SIZE 1024
+// Per-connection state touched by every receive and send.
+typedef struct {
+    int sockfd;
+    // Too much output is staged to read more for now (see peer_status).
+    bool reads_paused;
+    // The greeting staged by on_connect is all sent; nothing is read before.
+    bool greeted;
+    // A send made progress since the timer was last updated.
+    bool sent_some;
+    // Bytes received but not yet consumed by the handler. recvbuf is borrowed
+    // from recvbufs while there are any, and NULL otherwise.
+    uint8_t* recvbuf;
+    int recvbuf_end;
+    // Protocol state owned by the handler.
+    void* conn;
+    handler_out_t out;
+} peer_t;
+
+// Per-connection state only needed to hand out and look up slots and to time
+// peers out.
+typedef struct {
+    // Bumped every time the slot is released, so that ids handed out for the
+    // connection that had it stop matching (see peer_lookup).
+    uint32_t generation;
+    // Next free slot while on the free list, -1 at its end.
+    int next_free;
+    // What the timer is counting down to (see update_peer_timer).
+    peer_timeout_t timeout;
+    wheel_timer_t timer;
+} peer_cold_t;
+
+// Connection table indexed by slot rather than fd, so it's as dense as the
+// number of connections and grows with it. Released slots are reused first,
+// most recent first, while their memory is likely still cached. A slot's
+// peer_t and peer_cold_t sit in parallel pages, so the hot records are packed
+// together.
+typedef struct {
+    peer_t** pages;
+    peer_cold_t** cold_pages;
+    int capacity;
+    int free_head;
+} peer_table_t;
 
+// What a peer may still do in its current turn.
 typedef struct {
-    ProcessingState state;
-    uint8_t sendbuf[SENDBUF_SIZE];
-    int sendbuf_end;
-    int sendptr;
-} peer_state_t;
+    int bytes;
+    int frames;
+} budget_t;
+
+// A connection's slot and the generation it was given in, packed to fit a
+// pointer so it can be the reactor's callback argument.
+typedef uintptr_t peer_id_t;
+
+peer_table_t peers = {.free_head = -1};
+
+// Receive buffers not lent to a peer. Most peers are idle most of the time,
+// and an idle peer holds none.
+bufpool_t recvbufs;
+
+const handler_t* handler;
+
+// A peer isn't read from while it has output_high_watermark bytes or more of
+// output staged, until it's drained to output_low_watermark. That bounds what
+// a peer that doesn't read its responses can make us buffer, to the high
+// watermark plus the response to one recv.
+int output_high_watermark;
+int output_low_watermark;
+
+// IDLE_TIMEOUT_MS, READ_TIMEOUT_MS and WRITE_TIMEOUT_MS (see
+// update_peer_timer); 0, the default, turns a timeout off.
+int idle_timeout_ms;
+int read_timeout_ms;
+int write_timeout_ms;
+
+// BUDGET_BYTES and BUDGET_FRAMES: how much a peer may receive and send, and
+// how many frames it may have answered, in one turn (see on_peer_ready).
+int budget_bytes;
+int budget_frames;
+
+// Limits the peers served at once (see admission.h). Peers that don't fit the
+// table, or that the reactor can't watch, are turned away the same way.
+admission_t admission;
+
+static bool budget_left(const budget_t* budget) {
+    return budget->bytes > 0 && budget->frames > 0;
+}
 
-peer_state_t global_state[MAXFDs];
+static peer_t* peer_at(int peer) {
+    return &peers.pages[peer / PEER_PAGE_SLOTS][peer % PEER_PAGE_SLOTS];
+}
+
+static peer_cold_t* peer_cold_at(int peer) {
+    return &peers.cold_pages[peer / PEER_PAGE_SLOTS][peer % PEER_PAGE_SLOTS];
+}
+
+static peer_id_t peer_id(int peer) {
+    return (peer_id_t)peer | (peer_id_t)peer_cold_at(peer)->generation << PEER_INDEX_BITS;
+}
+
+// Returns the slot of the connection id was handed out for, or -1 if that
+// connection is gone.
+static int peer_lookup(peer_id_t id) {
+    int peer = (int)(id & (MAX_PEERS - 1));
+    if (peer >= peers.capacity || peer_id(peer) != id) {
+        return -1;
+    }
+    return peer;
+}
+
+// Takes a free slot for sockfd, adding a page of them if there's none.
+// Returns -1 if the table can't grow any further.
+static int peer_acquire(int sockfd) {
+    if (peers.free_head < 0) {
+        int capacity = peers.capacity + PEER_PAGE_SLOTS;
+        if (capacity > MAX_PEERS) {
+            return -1;
+        }
+        int num_pages = capacity / PEER_PAGE_SLOTS;
+        peers.pages = (peer_t**)realloc(peers.pages, sizeof(peer_t*) * num_pages);
+        peers.cold_pages = (peer_cold_t**)realloc(peers.cold_pages, sizeof(peer_cold_t*) * num_pages);
+        if (!peers.pages || !peers.cold_pages) {
+            die("out of memory growing the peer table to %d", capacity);
+        }
+        peers.pages[num_pages - 1] = (peer_t*)xmalloc(sizeof(peer_t) * PEER_PAGE_SLOTS);
+        peers.cold_pages[num_pages - 1] = (peer_cold_t*)xmalloc(sizeof(peer_cold_t) * PEER_PAGE_SLOTS);
+        peers.capacity = capacity;
+        // Chain the new slots in index order.
+        for (int i = capacity - 1; i >= capacity - PEER_PAGE_SLOTS; i--) {
+            peer_cold_at(i)->generation = 0;
+            peer_cold_at(i)->next_free = peers.free_head;
+            peers.free_head = i;
+        }
+    }
+
+    int peer = peers.free_head;
+    peers.free_head = peer_cold_at(peer)->next_free;
+    peer_at(peer)->sockfd = sockfd;
+    return peer;
+}
+
+static void peer_release(int peer) {
+    peer_cold_at(peer)->generation++;
+    peer_cold_at(peer)->next_free = peers.free_head;
+    peers.free_head = peer;
+}
 
 typedef struct {
     bool become_readable;
@@ -49,98 +207,296 @@ const fd_status_t fd_status_NORW = {
     .become_writable = false,
 };
 
-fd_status_t on_peer_connected(int client_sockfd, const struct sockaddr_in* peer_addr, socklen_t peer_addr_len) {
-    assert(client_sockfd < MAXFDs);
-    report_peer_connected(peer_addr, peer_addr_len);
+void on_peer_timeout(wheel_timer_t* timer, void* arg);
 
-    peer_state_t* peer_handler = &global_state[client_sockfd];
-    peer_handler->state = INITIAL_ACK;
-    peer_handler->sendbuf[0] = (uint8_t)'*';
-    peer_handler->sendptr = 0;
-    peer_handler->sendbuf_end = 1;
+fd_status_t on_peer_connected(int peer, const struct sockaddr_in* peer_addr, socklen_t peer_addr_len) {
+    report_peer_connected(peer_addr, peer_addr_len);
 
-    return fd_status_W;
+    peer_t* peer_handler = peer_at(peer);
+    peer_handler->out = (handler_out_t){0};
+    peer_handler->recvbuf = NULL;
+    peer_handler->recvbuf_end = 0;
+    peer_handler->reads_paused = false;
+    peer_handler->sent_some = false;
+    peer_cold_at(peer)->timeout = PEER_TIMEOUT_NONE;
+    wheel_timer_init(&peer_cold_at(peer)->timer, on_peer_timeout, (void*)peer_id(peer));
+    peer_handler->conn = handler->on_connect(&peer_handler->out);
+    peer_handler->greeted = peer_handler->out.len == 0;
+
+    // The greeting staged by on_connect (e.g. the initial ACK) is sent before
+    // anything is received.
+    return peer_handler->out.len > 0 ? fd_status_W : fd_status_R;
 }
 
-fd_status_t on_peer_received(int client_sockfd) {
-    assert(client_sockfd < MAXFDs);
-    peer_state_t* peer_handler = &global_state[client_sockfd];
+// Peers are read from and written to at once: written to while they have
+// output staged, and read from unless that output has reached the high
+// watermark and not yet drained to the low one, or their greeting isn't out
+// yet.
+static fd_status_t peer_status(peer_t* peer_handler) {
+    if (peer_handler->out.len == 0) {
+        peer_handler->greeted = true;
+    }
+    if (peer_handler->out.len >= output_high_watermark) {
+        peer_handler->reads_paused = true;
+    } else if (peer_handler->out.len <= output_low_watermark) {
+        peer_handler->reads_paused = false;
+    }
+    return (fd_status_t){
+        .become_readable = peer_handler->greeted && !peer_handler->reads_paused,
+        .become_writable = peer_handler->out.len > 0,
+    };
+}
 
-    if (peer_handler->state == INITIAL_ACK || peer_handler->sendptr < peer_handler->sendbuf_end) {
-        // Until the initial ACK has been sent to the peer, there's nothing we
-        // want to receive. Also, wait until all data staged for sending is sent to
-        // receive more data.
-        return fd_status_W;
+// Returns the peer's receive buffer to the pool once the handler has consumed
+// everything in it.
+static void detach_idle_recvbuf(peer_t* peer_handler) {
+    if (peer_handler->recvbuf && peer_handler->recvbuf_end == 0) {
+        bufpool_put(&recvbufs, peer_handler->recvbuf);
+        peer_handler->recvbuf = NULL;
     }
+}
 
-    uint8_t buf[1024];
-    int bytesRecv = recv(client_sockfd, buf, sizeof buf, 0);
-    if (bytesRecv == 0) {
-        printf("%d is disconnected\n", client_sockfd);
-        return fd_status_NORW;
-    } else if (bytesRecv < 0) {
-        if (bytesRecv == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
-            printf("%d is not ready to receive\n", client_sockfd);
-            return fd_status_R;
-        } else {
-            perror_die("recv");
+// Receives and handles what the peer sent, until it has sent nothing more, or
+// it has used up its budget or reached the output high watermark.
+fd_status_t on_peer_received(int peer, budget_t* budget) {
+    peer_t* peer_handler = peer_at(peer);
+    int client_sockfd = peer_handler->sockfd;
+
+    while (budget_left(budget)) {
+        if (peer_handler->recvbuf_end == RECVBUF_SIZE) {
+            printf("%d sent a frame exceeding %d bytes\n", client_sockfd, RECVBUF_SIZE);
+            return fd_status_NORW;
+        }
+
+        if (!peer_handler->recvbuf) {
+            peer_handler->recvbuf = (uint8_t*)bufpool_get(&recvbufs);
+        }
+        uint8_t* recvbuf = peer_handler->recvbuf;
+        uint8_t* buf = &recvbuf[peer_handler->recvbuf_end];
+        int bytesRecv = recv(client_sockfd, buf, RECVBUF_SIZE - peer_handler->recvbuf_end, 0);
+        if (bytesRecv == 0) {
+            printf("%d is disconnected\n", client_sockfd);
+            return fd_status_NORW;
+        } else if (bytesRecv < 0) {
+            if (bytesRecv == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+                printf("%d is not ready to receive\n", client_sockfd);
+                detach_idle_recvbuf(peer_handler);
+                return peer_status(peer_handler);
+            } else {
+                perror_die("recv");
+            }
+        }
+
+        peer_handler->recvbuf_end += bytesRecv;
+        int frames = peer_handler->out.frames;
+        int consumed = handler->on_data(peer_handler->conn, recvbuf, peer_handler->recvbuf_end, &peer_handler->out);
+        if (consumed == HANDLER_CLOSE) {
+            return fd_status_NORW;
+        }
+        peer_handler->recvbuf_end -= consumed;
+        memmove(recvbuf, &recvbuf[consumed], peer_handler->recvbuf_end);
+        detach_idle_recvbuf(peer_handler);
+        budget->bytes -= bytesRecv;
+        budget->frames -= peer_handler->out.frames - frames;
+
+        fd_status_t status = peer_status(peer_handler);
+        if (!status.become_readable) {
+            return status;
         }
     }
+    return peer_status(peer_handler);
+}
+
+fd_status_t on_peer_sent(int peer, budget_t* budget) {
+    peer_t* peer_state = peer_at(peer);
+    int client_sockfd = peer_state->sockfd;
 
-    bool ready_to_send_back = false;
-    for (int i = 0; i < bytesRecv; ++i) {
-        switch (peer_handler->state) {
-            case WAIT_FOR_MSG:
-                if (buf[i] == '^') peer_handler->state = IN_MSG;
-                break;
-            case IN_MSG:
-                if (buf[i] == '$') {
-                    peer_handler->state = WAIT_FOR_MSG;
-                } else {
-                    assert(peer_handler->sendbuf_end < SENDBUF_SIZE);
-                    peer_handler->sendbuf[peer_handler->sendbuf_end++] = buf[i] + 1;
-                    ready_to_send_back = true;
-                }
-                break;
+    if (peer_state->out.len == 0) {
+        return peer_status(peer_state);
+    }
+    // Send the staged chunks one at a time until the socket pushes back or the
+    // budget runs out.
+    while (peer_state->out.len > 0) {
+        if (budget->bytes <= 0) {
+            return peer_status(peer_state);
+        }
+        const uint8_t* data;
+        int msg_len = handler_out_peek(&peer_state->out, &data);
+        int bytes_sent = send(client_sockfd, (const char*)data, msg_len, 0);
+        if (bytes_sent == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                printf("server is sending message to %d\n", client_sockfd);
+                return peer_status(peer_state);
+            } else {
+                perror_die("send");
+            }
+        }
+        handler_out_consume(&peer_state->out, bytes_sent);
+        peer_state->sent_some = true;
+        budget->bytes -= bytes_sent;
+        if (bytes_sent < msg_len) {
+            printf("server is sending message to %d\n", client_sockfd);
+            return peer_status(peer_state);
         }
     }
+    printf("server sent messages successfully\n");
 
-    return (fd_status_t){
-        .become_readable = !ready_to_send_back,
-        .become_writable = ready_to_send_back,
+    // The handler may stage more output once the previous batch is out.
+    if (handler->on_writable) {
+        handler->on_writable(peer_state->conn, &peer_state->out);
+    }
+
+    return peer_status(peer_state);
+}
+
+void on_peer_closed(int peer) {
+    if (peer_at(peer)->recvbuf) {
+        bufpool_put(&recvbufs, peer_at(peer)->recvbuf);
+    }
+    handler_out_reset(&peer_at(peer)->out);
+    handler->on_close(peer_at(peer)->conn);
+    admission_leave(&admission);
+}
+
+reactor_t* reactor;
+
+int listen_sockfd;
+
+// While admission is paused the listening socket isn't watched, so new peers
+// wait in the backlog until a connection closes.
+void update_listener_interest(void) {
+    reactor_set_interest(reactor, listen_sockfd, admission_paused(&admission) ? 0 : REACTOR_READ);
+}
+
+// Arms the peer's timer for what it's waiting on: its staged output to be
+// sent (WRITE_TIMEOUT_MS, restarted whenever a send makes progress), the rest
+// of a frame it has started (READ_TIMEOUT_MS, from the frame's first bytes,
+// whether the handler has consumed them or left them in recvbuf),
+// or anything at all (IDLE_TIMEOUT_MS, restarted by every event). Arming is
+// O(1) however many peers there are, so this runs after every event.
+static void update_peer_timer(int peer) {
+    peer_t* peer_handler = peer_at(peer);
+    peer_cold_t* peer_cold = peer_cold_at(peer);
+    peer_timeout_t timeout;
+    int timeout_ms;
+    if (peer_handler->out.len > 0) {
+        timeout = PEER_TIMEOUT_WRITE;
+        timeout_ms = write_timeout_ms;
+    } else if (peer_handler->recvbuf_end > 0 || (handler->in_frame && handler->in_frame(peer_handler->conn))) {
+        timeout = PEER_TIMEOUT_READ;
+        timeout_ms = read_timeout_ms;
+    } else {
+        timeout = PEER_TIMEOUT_IDLE;
+        timeout_ms = idle_timeout_ms;
+    }
+    bool restart = timeout != peer_cold->timeout || timeout == PEER_TIMEOUT_IDLE ||
+                   (timeout == PEER_TIMEOUT_WRITE && peer_handler->sent_some);
+    peer_cold->timeout = timeout;
+    peer_handler->sent_some = false;
+
+    if (timeout_ms <= 0) {
+        timer_wheel_cancel(reactor_timers(reactor), &peer_cold->timer);
+    } else if (restart) {
+        timer_wheel_arm(reactor_timers(reactor), &peer_cold->timer, timeout_ms);
+    }
+}
+
+// Watches the peer's socket for what status asks for, or closes it when
+// that's nothing.
+void apply_peer_status(int peer, fd_status_t status) {
+    int fd = peer_at(peer)->sockfd;
+    if (!status.become_readable && !status.become_writable) {
+        printf("socket %d closing\n", fd);
+        timer_wheel_cancel(reactor_timers(reactor), &peer_cold_at(peer)->timer);
+        reactor_unregister(reactor, fd);
+        on_peer_closed(peer);
+        closesocket(fd);
+        peer_release(peer);
+        update_listener_interest();
+        return;
+    }
+    reactor_set_interest(reactor, fd,
+                         (status.become_readable ? REACTOR_READ : 0) | (status.become_writable ? REACTOR_WRITE : 0));
+    update_peer_timer(peer);
+}
+
+void on_peer_timeout(wheel_timer_t* timer, void* arg) {
+    int peer = peer_lookup((peer_id_t)arg);
+    if (peer < 0) {
+        die("timeout reported for a stale peer");
+    }
+    static const char* waiting_for[] = {
+        [PEER_TIMEOUT_IDLE] = "anything",
+        [PEER_TIMEOUT_READ] = "the rest of a frame",
+        [PEER_TIMEOUT_WRITE] = "its output to be sent",
     };
+    printf("%d timed out waiting for %s\n", peer_at(peer)->sockfd, waiting_for[peer_cold_at(peer)->timeout]);
+    apply_peer_status(peer, fd_status_NORW);
 }
 
-fd_status_t on_peer_sent(int client_sockfd) {
-    assert(client_sockfd < MAXFDs);
-    peer_state_t* peer_state = &global_state[client_sockfd];
+void on_peer_ready(reactor_t* reactor, int fd, int events, void* arg) {
+    int peer = peer_lookup((peer_id_t)arg);
+    if (peer < 0 || peer_at(peer)->sockfd != fd) {
+        die("readiness of socket %d reported for a stale peer", fd);
+    }
 
-    if (peer_state->sendptr >= peer_state->sendbuf_end) {
-        return fd_status_RW;
+    // Send first, so that the output a recv stages can go out with what's
+    // left, and a peer at the high watermark may drain enough to be read.
+    budget_t budget = {budget_bytes, budget_frames};
+    fd_status_t status = fd_status_RW;
+    if (events & REACTOR_WRITE) {
+        printf("server want to send back a message to %d\n", fd);
+        status = on_peer_sent(peer, &budget);
+    }
+    if ((events & REACTOR_READ) && status.become_readable) {
+        printf("%d sent a new message to server\n", fd);
+        status = on_peer_received(peer, &budget);
     }
-    int msg_len = peer_state->sendbuf_end - peer_state->sendptr;
-    int bytes_sent = send(client_sockfd, &peer_state->sendbuf[peer_state->sendptr], msg_len, 0);
-    if (bytes_sent == SOCKET_ERROR) {
+    apply_peer_status(peer, status);
+
+    if (!budget_left(&budget) && (status.become_readable || status.become_writable)) {
+        // The peer may have more to do, but its turn is over: it carries on
+        // once every other peer ready now has had theirs.
+        printf("%d used up its budget\n", fd);
+        reactor_set_interest(reactor, fd, 0);
+        reactor_defer(reactor, fd,
+                      (status.become_readable ? REACTOR_READ : 0) | (status.become_writable ? REACTOR_WRITE : 0));
+    }
+}
+
+void on_listener_ready(reactor_t* reactor, int server_sockfd, int events, void* arg) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    int client_sockfd = accept(server_sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+    if (client_sockfd == SOCKET_ERROR) {
         if (WSAGetLastError() == WSAEWOULDBLOCK) {
-            return fd_status_W;
+            printf("accept returned EAGAIN or EWOULDBLOCK\n");
         } else {
-            perror_die("send");
+            perror_die("accept");
         }
+        return;
     }
-    if (bytes_sent < msg_len) {
-        printf("server is sending message to %d", client_sockfd);
-        peer_state->sendptr += bytes_sent;
-        return fd_status_W;
-    } else {
-        printf("server sent messages successfully\n");
-        peer_state->sendptr = 0;
-        peer_state->sendbuf_end = 0;
-
-        // Special-case state transition in if we were in INITIAL_ACK until now.
-        if (peer_state->state == INITIAL_ACK) peer_state->state = WAIT_FOR_MSG;
 
-        return fd_status_R;
+    int peer = -1;
+    if (!admission_try_enter(&admission)) {
+        printf("Overloaded, turning away client sockfd: %d\n", client_sockfd);
+        admission_reject(client_sockfd);
+    } else if ((peer = peer_acquire(client_sockfd)) < 0) {
+        printf("Peer table full, turning away client sockfd: %d\n", client_sockfd);
+        admission_leave(&admission);
+        admission_reject(client_sockfd);
+    } else if (!reactor_register(reactor, client_sockfd, 0, on_peer_ready, (void*)peer_id(peer))) {
+        printf("%s can't watch more sockets, turning away client sockfd: %d\n", reactor_backend_name(reactor),
+               client_sockfd);
+        peer_release(peer);
+        admission_leave(&admission);
+        admission_reject(client_sockfd);
+    } else {
+        printf("Established client sockfd: %d\n", client_sockfd);
+        make_socket_non_blocking(client_sockfd);
+        apply_peer_status(peer, on_peer_connected(peer, &peer_addr, peer_addr_len));
     }
+    update_listener_interest();
 }
 
 int main(int argc, char** argv) {
@@ -153,130 +509,41 @@ int main(int argc, char** argv) {
     if (argc >= 2) {
         portnum = atoi(argv[1]);
     }
-    printf("Serving on port %d\n", portnum);
+    handler = handler_from_env();
+    admission_init_from_env(&admission, 0);
+    bufpool_init(&recvbufs, RECVBUF_SIZE, RECVBUF_SLAB);
+    output_high_watermark = getenv_int("OUTPUT_HIGH_WATERMARK", DEFAULT_OUTPUT_HIGH_WATERMARK);
+    output_low_watermark = getenv_int("OUTPUT_LOW_WATERMARK", DEFAULT_OUTPUT_LOW_WATERMARK);
+    if (output_high_watermark <= 0 || output_low_watermark < 0 || output_low_watermark > output_high_watermark) {
+        die("need 0 <= OUTPUT_LOW_WATERMARK <= OUTPUT_HIGH_WATERMARK, OUTPUT_HIGH_WATERMARK > 0");
+    }
+    idle_timeout_ms = getenv_int("IDLE_TIMEOUT_MS", 0);
+    read_timeout_ms = getenv_int("READ_TIMEOUT_MS", 0);
+    write_timeout_ms = getenv_int("WRITE_TIMEOUT_MS", 0);
+    budget_bytes = getenv_int("BUDGET_BYTES", DEFAULT_BUDGET_BYTES);
+    budget_frames = getenv_int("BUDGET_FRAMES", DEFAULT_BUDGET_FRAMES);
+    if (budget_bytes <= 0 || budget_frames <= 0) {
+        die("need BUDGET_BYTES > 0 and BUDGET_FRAMES > 0");
+    }
 
-    int server_sockfd = listen_inet_socket(portnum);
-    printf("server sockfd: %d\n", server_sockfd);
+    // BACKEND picks how readiness is polled (see reactor.h); the callbacks
+    // above are the same with all of them.
+    reactor = reactor_create(reactor_backend_from_env());
+    printf("Serving %s on port %d over %s\n", handler->name, portnum, reactor_backend_name(reactor));
+
+    listen_sockfd = listen_inet_socket(portnum);
+    printf("server sockfd: %d\n", listen_sockfd);
 
     // The select() manpage warns that select() can return a read notification
     // for a socket that isn't actually readable. Thus using blocking I/O isn't
     // safe.
-    make_socket_non_blocking(server_sockfd);
+    make_socket_non_blocking(listen_sockfd);
 
-    if (server_sockfd >= FD_SETSIZE) {
-        die("server socket fd (%d) >= FD_SETSIZE (%d)", server_sockfd, FD_SETSIZE);
+    if (!reactor_register(reactor, listen_sockfd, REACTOR_READ, on_listener_ready, NULL)) {
+        die("%s can't watch the server socket fd (%d)", reactor_backend_name(reactor), listen_sockfd);
     }
+    reactor_run(reactor);
 
-    // The "master" sets are owned by the loop, tracking which FDs we want to
-    // monitor for receiving and which FDs we want to monitor for sending.
-    fd_set readable_fd_monitor_set;
-    FD_ZERO(&readable_fd_monitor_set);
-    fd_set writable_fd_monitor_set;
-    FD_ZERO(&writable_fd_monitor_set);
-
-    // The server socket is always monitored for recv, to detect when new
-    // peer connections are incoming.
-    FD_SET(server_sockfd, &readable_fd_monitor_set);
-
-    // For more efficiency, fdset_max tracks the maximal FD seen so far; this
-    // makes it unnecessary for select to iterate all the way to FD_SETSIZE on
-    // every call.
-    int fdset_max = server_sockfd;
-    int loop_num = 0;
-
-    while (1) {
-        fd_set read_fd_set = readable_fd_monitor_set;
-        fd_set write_fd_set = writable_fd_monitor_set;
-
-        int num_ready = select(fdset_max + 1, &read_fd_set, &write_fd_set, NULL, NULL);
-        if (num_ready == SOCKET_ERROR) {
-            perror_die("[MAIN-LOOP] select error");
-        }
-        printf("Loop: %d, num_ready: %d\n", loop_num++, num_ready);
-
-        // num_ready tells us the total number of ready events; if one socket is both
-        // readable and writable it will be 2. Therefore, it's decremented when
-        // either a readable or a writable socket is encountered.
-        for (int fd = 0; fd <= fdset_max && num_ready > 0; fd++) {
-            // Check if this fd became readable.
-            if (FD_ISSET(fd, &read_fd_set)) {
-                num_ready--;
-
-                printf("[MAIN-LOOP] reading message from %d\n", fd);
-                if (fd == server_sockfd) {
-                    struct sockaddr_in peer_addr;
-                    socklen_t peer_addr_len = sizeof(peer_addr);
-                    int client_sockfd = accept(server_sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
-                    if (client_sockfd == SOCKET_ERROR) {
-                        if (WSAGetLastError() == WSAEWOULDBLOCK) {
-                            printf("accept returned EAGAIN or EWOULDBLOCK\n");
-                        } else {
-                            perror_die("accept");
-                        }
-                    } else {
-                        printf("Established client sockfd: %d\n", client_sockfd);
-                        make_socket_non_blocking(client_sockfd);
-                        if (client_sockfd > fdset_max) {
-                            if (client_sockfd >= FD_SETSIZE) {
-                                die("socket fd (%d) >= FD_SETSIZE (%d)", client_sockfd, FD_SETSIZE);
-                            }
-                            fdset_max = client_sockfd;
-                        }
-
-                        fd_status_t client_status = on_peer_connected(client_sockfd, &peer_addr, peer_addr_len);
-                        if (client_status.become_readable) {
-                            FD_SET(client_sockfd, &readable_fd_monitor_set);
-                        } else {
-                            FD_CLR(client_sockfd, &readable_fd_monitor_set);
-                        }
-                        if (client_status.become_writable) {
-                            FD_SET(client_sockfd, &writable_fd_monitor_set);
-                        } else {
-                            FD_CLR(client_sockfd, &writable_fd_monitor_set);
-                        }
-                    }
-                } else {
-                    printf("%d sent a new message to server\n", fd);
-                    fd_status_t client_status = on_peer_received(fd);
-                    if (client_status.become_readable) {
-                        FD_SET(fd, &readable_fd_monitor_set);
-                    } else {
-                        FD_CLR(fd, &readable_fd_monitor_set);
-                    }
-                    if (client_status.become_writable) {
-                        FD_SET(fd, &writable_fd_monitor_set);
-                    } else {
-                        FD_CLR(fd, &writable_fd_monitor_set);
-                    }
-                    if (!client_status.become_readable && !client_status.become_writable) {
-                        printf("socket %d closing\n", fd);
-                        closesocket(fd);
-                    }
-                }
-            }
-
-            // Check if this fd became writable.
-            if (FD_ISSET(fd, &write_fd_set)) {
-                num_ready--;
-                printf("server want to send back a message to %d\n", fd);
-                fd_status_t client_status = on_peer_sent(fd);
-                if (client_status.become_readable) {
-                    FD_SET(fd, &readable_fd_monitor_set);
-                } else {
-                    FD_CLR(fd, &readable_fd_monitor_set);
-                }
-                if (client_status.become_writable) {
-                    FD_SET(fd, &writable_fd_monitor_set);
-                } else {
-                    FD_CLR(fd, &writable_fd_monitor_set);
-                }
-                if (!client_status.become_readable && !client_status.become_writable) {
-                    printf("socket %d closing\n", fd);
-                    closesocket(fd);
-                }
-            }
-        }
-    }
     cleanupWinsock();
     return 0;
-}
\ No newline at end of file
+}
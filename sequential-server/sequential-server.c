@@ -1,53 +1,94 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "handler.h"
 #include "utils.h"
 
-typedef enum {
-  WAIT_FOR_MSG,
-  IN_MSG,
-} ProcessingState;
+// Per-connection limits, so a single slow, idle or chatty client can't hold
+// up the ones queued behind it. 0 disables a limit.
+typedef struct {
+  // Longest wait for the peer to send anything (SO_RCVTIMEO).
+  int read_timeout_ms;
+  // Longest wait for the peer to take our output (SO_SNDTIMEO).
+  int write_timeout_ms;
+  // Frames answered before the connection is closed.
+  int max_frames;
+} connection_limits_t;
 
-void serve_connection(int sockfd) {
-  // echo "*" back to client
-  if (send(sockfd, "*", 1, 0) < 1) {
-    perror_die("[SERVE-CONNECTION] send * die");
+// Reads READ_TIMEOUT_MS, WRITE_TIMEOUT_MS and MAX_FRAMES.
+connection_limits_t connection_limits_from_env(void) {
+  connection_limits_t limits = {
+      .read_timeout_ms = getenv_int("READ_TIMEOUT_MS", 10000),
+      .write_timeout_ms = getenv_int("WRITE_TIMEOUT_MS", 10000),
+      .max_frames = getenv_int("MAX_FRAMES", 0),
+  };
+  return limits;
+}
+
+void set_socket_timeout(int sockfd, int optname, int timeout_ms) {
+  DWORD timeout = timeout_ms;
+  if (setsockopt(sockfd, SOL_SOCKET, optname, (const char*)&timeout, sizeof(timeout)) == SOCKET_ERROR) {
+    perror("[SERVE-CONNECTION] setsockopt timeout");
+  }
+}
+
+// Serves sockfd until the peer leaves or breaks a limit. Any failure only ends
+// this connection; the server moves on to the next one.
+void serve_connection(int sockfd, const handler_t* handler, const connection_limits_t* limits) {
+  if (limits->read_timeout_ms > 0) {
+    set_socket_timeout(sockfd, SO_RCVTIMEO, limits->read_timeout_ms);
   }
-  // change state to wait for message
-  ProcessingState state = WAIT_FOR_MSG;
+  if (limits->write_timeout_ms > 0) {
+    set_socket_timeout(sockfd, SO_SNDTIMEO, limits->write_timeout_ms);
+  }
+
+  handler_out_t out = {0};
+  // on_connect stages the greeting (e.g. "*" for echo), sent before reading.
+  void* conn = handler->on_connect(&out);
+
+  // Bytes received but not consumed by the handler yet.
+  uint8_t buf[1024];
+  int pending = 0;
 
   while (1) {
-    uint8_t buf[1024];
-    int len = recv(sockfd, buf, sizeof(buf), 0);
+    if (out.len > 0) {
+      if (handler_out_send_all(sockfd, &out) == SOCKET_ERROR) {
+        printf("[SERVE-CONNECTION] send failed (%d), closing\n", WSAGetLastError());
+        break;
+      }
+      if (handler->on_writable) {
+        handler->on_writable(conn, &out);
+        continue;
+      }
+    }
+
+    if (limits->max_frames > 0 && out.frames >= limits->max_frames) {
+      printf("[SERVE-CONNECTION] %d frames served, closing\n", out.frames);
+      break;
+    }
+    if (pending == sizeof(buf)) {
+      printf("[SERVE-CONNECTION] frame exceeds %d bytes, closing\n", (int)sizeof(buf));
+      break;
+    }
+    int len = recv(sockfd, buf + pending, sizeof(buf) - pending, 0);
     if (len == SOCKET_ERROR) {
-      perror_die("[SERVE-CONNECTION] recv die");
+      // WSAETIMEDOUT when the peer stayed quiet past the read timeout.
+      printf("[SERVE-CONNECTION] recv failed (%d), closing\n", WSAGetLastError());
+      break;
     } else if (len == 0)
       break;
 
-    for (int i = 0; i < len; i++) {
-      switch (state) {
-        case WAIT_FOR_MSG:
-          if (buf[i] == '^') {
-            state = IN_MSG;
-          }
-          break;
-        case IN_MSG:
-          if (buf[i] == '$') {
-            state = WAIT_FOR_MSG;
-          } else {
-            buf[i] += 1;
-            if (send(sockfd, &buf[i], 1, 0) < 1) {
-              perror("[SERVE-CONNECTION] send buf die");
-              closesocket(sockfd);
-              return;
-            }
-          }
-          break;
-        default:
-          break;
-      }
+    int consumed = handler->on_data(conn, buf, pending + len, &out);
+    if (consumed == HANDLER_CLOSE) {
+      break;
     }
+    pending += len - consumed;
+    memmove(buf, buf + consumed, pending);
   }
+  handler_out_reset(&out);
+  handler->on_close(conn);
   closesocket(sockfd);
 }
 
@@ -60,7 +101,9 @@ int main(int argc, char** argv) {
   if (argc >= 2) {
     portnum = atoi(argv[1]);
   }
-  printf("Serving on port: %d\n", portnum);
+  const handler_t* handler = handler_from_env();
+  connection_limits_t limits = connection_limits_from_env();
+  printf("Serving %s on port: %d\n", handler->name, portnum);
 
   int sockfd = listen_inet_socket(portnum);
   printf("sockfd: %d\n", sockfd);
@@ -71,12 +114,14 @@ int main(int argc, char** argv) {
 
     int newSockFd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);  // return a new connection
     if (newSockFd < 0) {
-      perror_die("[MAIN-LOOP] ERROR CONNECTION on accept");
+      // E.g. the peer reset the connection while it waited in the backlog.
+      printf("[MAIN-LOOP] accept failed (%d)\n", WSAGetLastError());
+      continue;
     }
     printf("newSockFd: %d\n", newSockFd);
 
     report_peer_connected(&peer_addr, peer_addr_len);
-    serve_connection(newSockFd);
+    serve_connection(newSockFd, handler, &limits);
     printf("[MAIN-LOOP] PEERING DONE!!!\n");
   }
   cleanupWinsock();
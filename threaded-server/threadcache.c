@@ -0,0 +1,98 @@
+#include "threadcache.h"
+
+#include <process.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+// One thread of the cache. sockfd is the connection it serves next, or -1
+// while it's parked waiting for one.
+typedef struct {
+  threadcache_t* cache;
+  pthread_cond_t wakeup;
+  int sockfd;
+} cached_thread_t;
+
+struct threadcache {
+  threadcache_serve_fn serve;
+  void* arg;
+  // Stack reserved for new threads, or 0 for the executable's default.
+  size_t stack_size;
+
+  pthread_mutex_t lock;
+  // Parked threads; the most recently parked is reused first, as its stack is
+  // the most likely to still be in cache.
+  cached_thread_t** idle;
+  int num_idle;
+  int max_idle;
+};
+
+static unsigned __stdcall cached_thread(void* arg) {
+  cached_thread_t* self = (cached_thread_t*)arg;
+  threadcache_t* cache = self->cache;
+  while (1) {
+    cache->serve(self->sockfd, cache->arg);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->num_idle == cache->max_idle) {
+      pthread_mutex_unlock(&cache->lock);
+      break;
+    }
+    self->sockfd = -1;
+    cache->idle[cache->num_idle++] = self;
+    while (self->sockfd == -1) {
+      pthread_cond_wait(&self->wakeup, &cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  pthread_cond_destroy(&self->wakeup);
+  free(self);
+  return 0;
+}
+
+threadcache_t* threadcache_create(int max_idle, size_t stack_size, threadcache_serve_fn serve, void* arg) {
+  threadcache_t* cache = (threadcache_t*)xmalloc(sizeof(*cache));
+  cache->serve = serve;
+  cache->arg = arg;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->max_idle = max_idle > 0 ? max_idle : 0;
+  cache->num_idle = 0;
+  cache->idle = (cached_thread_t**)xmalloc(sizeof(cached_thread_t*) * (cache->max_idle + 1));
+
+  cache->stack_size = stack_size;
+  return cache;
+}
+
+bool threadcache_run(threadcache_t* cache, int sockfd) {
+  pthread_mutex_lock(&cache->lock);
+  if (cache->num_idle > 0) {
+    cached_thread_t* parked = cache->idle[--cache->num_idle];
+    parked->sockfd = sockfd;
+    pthread_cond_signal(&parked->wakeup);
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  cached_thread_t* self = (cached_thread_t*)xmalloc(sizeof(*self));
+  self->cache = cache;
+  self->sockfd = sockfd;
+  pthread_cond_init(&self->wakeup, NULL);
+  // Created with _beginthreadex rather than pthread_create: winpthreads hands
+  // a stack size to CreateThread as the stack to commit up front, leaving the
+  // reservation at the executable's default. Only as a reservation does a
+  // smaller size mean less memory per thread. Not CreateThread itself, as the
+  // thread runs CRT code.
+  uintptr_t the_thread = _beginthreadex(NULL, (unsigned)cache->stack_size, cached_thread, self,
+                                        cache->stack_size > 0 ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, NULL);
+  if (!the_thread) {
+    pthread_cond_destroy(&self->wakeup);
+    free(self);
+    return false;
+  }
+  CloseHandle((HANDLE)the_thread);
+  return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Thread-per-connection without paying for a new thread per connection: a
+// thread that finished serving its connection parks in the cache, and the next
+// connection is handed to it instead of to a freshly created thread. Unlike
+// threadpool.h the number of threads is not bounded; the cache only bounds how
+// many idle ones are kept around.
+
+typedef struct threadcache threadcache_t;
+
+// Serves one connection to completion on a cached or new thread.
+typedef void (*threadcache_serve_fn)(int sockfd, void* arg);
+
+// Keeps up to max_idle finished threads for reuse (0 disables reuse). New
+// threads reserve stack_size bytes of address space for their stack, or the
+// executable's default (1 MiB) if 0; pages are committed as the stack grows.
+threadcache_t* threadcache_create(int max_idle, size_t stack_size, threadcache_serve_fn serve, void* arg);
+
+// Has serve(sockfd, arg) called on an idle cached thread, or on a new one if
+// none is idle. Returns false if no thread could be created, leaving sockfd to
+// the caller.
+bool threadcache_run(threadcache_t* cache, int sockfd);
@@ -1,72 +1,182 @@
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
+#include "admission.h"
+#include "handler.h"
+#include "threadcache.h"
+#include "threadpool.h"
 #include "utils.h"
 
-typedef struct {
-  int sockfd;
-} thread_config_t;
-
 typedef enum {
-  WAIT_FOR_MSG,
-  IN_MSG,
-} ProcessingState;
-
-void serve_connection(int sockfd) {
-  // echo "*" back to client
-  if (send(sockfd, "*", 1, 0) < 1) {
-    perror_die("[SERVE-CONNECTION] send * die");
-  }
-  // change state to wait for message
-  ProcessingState state = WAIT_FOR_MSG;
+  QUEUE_FULL_BLOCK,
+  QUEUE_FULL_REJECT,
+  QUEUE_FULL_CLOSE,
+} queue_full_policy_t;
+
+void serve_connection(int sockfd, const handler_t* handler) {
+  handler_out_t out = {0};
+  // on_connect stages the greeting (e.g. "*" for echo), sent before reading.
+  void* conn = handler->on_connect(&out);
+
+  // Bytes received but not consumed by the handler yet.
+  uint8_t buf[1024];
+  int pending = 0;
 
   while (1) {
-    uint8_t buf[1024];
-    int len = recv(sockfd, buf, sizeof(buf), 0);
+    if (out.len > 0) {
+      if (handler_out_send_all(sockfd, &out) == SOCKET_ERROR) {
+        perror("[SERVE-CONNECTION] send die");
+        break;
+      }
+      if (handler->on_writable) {
+        handler->on_writable(conn, &out);
+        continue;
+      }
+    }
+
+    if (pending == sizeof(buf)) {
+      printf("[SERVE-CONNECTION] frame exceeds %d bytes, closing\n", (int)sizeof(buf));
+      break;
+    }
+    int len = recv(sockfd, buf + pending, sizeof(buf) - pending, 0);
     if (len == SOCKET_ERROR) {
       perror_die("[SERVE-CONNECTION] recv die");
     } else if (len == 0)
       break;
 
-    for (int i = 0; i < len; i++) {
-      switch (state) {
-        case WAIT_FOR_MSG:
-          if (buf[i] == '^') {
-            state = IN_MSG;
-          }
-          break;
-        case IN_MSG:
-          if (buf[i] == '$') {
-            state = WAIT_FOR_MSG;
-          } else {
-            buf[i] += 1;
-            if (send(sockfd, &buf[i], 1, 0) < 1) {
-              perror("[SERVE-CONNECTION] send buf die");
-              closesocket(sockfd);
-              return;
-            }
-          }
-          break;
-        default:
-          break;
-      }
+    int consumed = handler->on_data(conn, buf, pending + len, &out);
+    if (consumed == HANDLER_CLOSE) {
+      break;
     }
+    pending += len - consumed;
+    memmove(buf, buf + consumed, pending);
   }
+  handler_out_reset(&out);
+  handler->on_close(conn);
   closesocket(sockfd);
 }
 
-void* server_thread(void* arg) {
-  thread_config_t* thread_config = (thread_config_t*)arg;
-  int sockfd = thread_config->sockfd;
-  free(thread_config);
-  pthread_t thread_id = pthread_self();
-  // printf("Thread %p created to handle connection with socket %d\n", (void*)thread_id, sockfd);
-  serve_connection(sockfd);
-  // printf("Thread %p done\n", (void*)thread_id);
+// Limits the connections served by threads of their own (see admission.h).
+admission_t admission;
+
+// Runs on a pool worker; arg is the handler.
+void serve_handler_connection(int sockfd, void* arg) {
+  serve_connection(sockfd, (const handler_t*)arg);
+}
+
+// Runs on a thread of the cache; arg is the handler.
+void serve_admitted_connection(int sockfd, void* arg) {
+  serve_connection(sockfd, (const handler_t*)arg);
+  admission_leave(&admission);
+}
+
+// Leader/follower: the thread holding leader_lock is the leader, the only one
+// in accept(); the others are followers queued on the lock. The leader
+// promotes the next follower by releasing the lock as soon as it has a
+// connection, then serves that connection itself, so no queue or cross-thread
+// wakeup sits between accept and the handler.
+typedef struct {
+  int listen_sockfd;
+  const handler_t* handler;
+  pthread_mutex_t leader_lock;
+  int stats_interval_ms;
+  // Connections served since the last report; for each, how long the thread
+  // that accepted it had queued on leader_lock as a follower, and how long it
+  // then took to serve.
+  pthread_mutex_t stats_lock;
+  uint64_t served;
+  uint64_t wait_ns_total;
+  uint64_t wait_ns_max;
+  uint64_t serve_ns_total;
+  uint64_t serve_ns_max;
+} leader_follower_t;
+
+void* leader_follower_thread(void* arg) {
+  leader_follower_t* lf = (leader_follower_t*)arg;
+  while (1) {
+    uint64_t following_since = monotonic_ns();
+    pthread_mutex_lock(&lf->leader_lock);
+    uint64_t leading_since = monotonic_ns();
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    int sockfd = accept(lf->listen_sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+    pthread_mutex_unlock(&lf->leader_lock);
+    if (sockfd < 0) {
+      perror_die("[LEADER] ERROR CONNECTION on accept");
+    }
+    report_peer_connected(&peer_addr, peer_addr_len);
+    uint64_t started_at = monotonic_ns();
+    serve_connection(sockfd, lf->handler);
+    uint64_t done_at = monotonic_ns();
+
+    if (lf->stats_interval_ms > 0) {
+      uint64_t wait_ns = leading_since - following_since;
+      uint64_t serve_ns = done_at - started_at;
+      pthread_mutex_lock(&lf->stats_lock);
+      lf->served++;
+      lf->wait_ns_total += wait_ns;
+      if (wait_ns > lf->wait_ns_max) lf->wait_ns_max = wait_ns;
+      lf->serve_ns_total += serve_ns;
+      if (serve_ns > lf->serve_ns_max) lf->serve_ns_max = serve_ns;
+      pthread_mutex_unlock(&lf->stats_lock);
+    }
+  }
+  return 0;
+}
+
+void* leader_follower_stats_thread(void* arg) {
+  leader_follower_t* lf = (leader_follower_t*)arg;
+  while (1) {
+    Sleep(lf->stats_interval_ms);
+
+    pthread_mutex_lock(&lf->stats_lock);
+    uint64_t served = lf->served;
+    uint64_t wait_ns_total = lf->wait_ns_total, wait_ns_max = lf->wait_ns_max;
+    uint64_t serve_ns_total = lf->serve_ns_total, serve_ns_max = lf->serve_ns_max;
+    lf->served = lf->wait_ns_total = lf->wait_ns_max = lf->serve_ns_total = lf->serve_ns_max = 0;
+    pthread_mutex_unlock(&lf->stats_lock);
+
+    if (served == 0) {
+      continue;
+    }
+    printf("[LF-STATS] %.1f conn/s; follower wait avg %" PRIu64 " us max %" PRIu64 " us; serve avg %" PRIu64
+           " us max %" PRIu64 " us\n",
+           served * 1000.0 / lf->stats_interval_ms, wait_ns_total / served / 1000, wait_ns_max / 1000,
+           serve_ns_total / served / 1000, serve_ns_max / 1000);
+  }
   return 0;
 }
 
+queue_full_policy_t queue_full_policy_from_env(void) {
+  char* policy = getenv("QUEUE_FULL");
+  if (!policy || !strcmp(policy, "BLOCK")) {
+    return QUEUE_FULL_BLOCK;
+  } else if (!strcmp(policy, "REJECT")) {
+    return QUEUE_FULL_REJECT;
+  } else if (!strcmp(policy, "CLOSE")) {
+    return QUEUE_FULL_CLOSE;
+  }
+  die("unknown QUEUE_FULL: %s", policy);
+  return QUEUE_FULL_BLOCK;
+}
+
+threadpool_queue_t pool_queue_from_env(void) {
+  char* queue = getenv("POOL_QUEUE");
+  if (!queue || !strcmp(queue, "STEAL")) {
+    return THREADPOOL_WORK_STEALING;
+  } else if (!strcmp(queue, "SHARED")) {
+    return THREADPOOL_SHARED;
+  } else if (!strcmp(queue, "RINGS")) {
+    return THREADPOOL_RINGS;
+  }
+  die("unknown POOL_QUEUE: %s", queue);
+  return THREADPOOL_WORK_STEALING;
+}
+
 int main(int argc, char** argv) {
   printf("here");
   if (initializeWinsock() != 0) {
@@ -77,12 +187,86 @@ int main(int argc, char** argv) {
   if (argc >= 2) {
     portnum = atoi(argv[1]);
   }
-  printf("Serving on port: %d\n", portnum);
+  const handler_t* handler = handler_from_env();
+  printf("Serving %s on port: %d\n", handler->name, portnum);
 
   int sockfd = listen_inet_socket(portnum);
   printf("sockfd: %d\n", sockfd);
 
+  // MODE=LF serves connections from POOL_THREADS leader/follower threads,
+  // including this one. STATS_INTERVAL_MS reports throughput and latency as
+  // in MODE=POOL.
+  char* mode = getenv("MODE");
+  if (mode && !strcmp(mode, "LF")) {
+    int num_threads = getenv_int("POOL_THREADS", 64);
+    leader_follower_t lf = {sockfd, handler};
+    pthread_mutex_init(&lf.leader_lock, NULL);
+    pthread_mutex_init(&lf.stats_lock, NULL);
+    lf.stats_interval_ms = getenv_int("STATS_INTERVAL_MS", 0);
+    if (lf.stats_interval_ms > 0) {
+      pthread_t the_thread;
+      if (pthread_create(&the_thread, NULL, leader_follower_stats_thread, &lf) != 0) {
+        die("pthread_create failed for stats thread");
+      }
+      pthread_detach(the_thread);
+    }
+    for (int i = 1; i < num_threads; i++) {
+      pthread_t the_thread;
+      if (pthread_create(&the_thread, NULL, leader_follower_thread, &lf) != 0) {
+        die("pthread_create failed for follower %d", i);
+      }
+      pthread_detach(the_thread);
+    }
+    printf("Leader/follower with %d threads\n", num_threads);
+    leader_follower_thread(&lf);
+  }
+
+  // MODE=POOL serves connections from a fixed set of workers instead of a
+  // thread per connection. When all workers are busy and QUEUE_SIZE
+  // connections are waiting, QUEUE_FULL decides: BLOCK stops accepting until
+  // there is room, REJECT answers BUSY and closes, CLOSE just closes.
+  // POOL_QUEUE picks how connections reach the workers: STEAL (default),
+  // SHARED or RINGS (see threadpool_queue_t).
+  threadpool_t* pool = NULL;
+  queue_full_policy_t queue_full_policy = QUEUE_FULL_BLOCK;
+  if (mode && !strcmp(mode, "POOL")) {
+    threadpool_config_t config = {
+        .num_threads = getenv_int("POOL_THREADS", 64),
+        .queue_size = getenv_int("QUEUE_SIZE", 256),
+        .queue = pool_queue_from_env(),
+        .stats_interval_ms = getenv_int("STATS_INTERVAL_MS", 0),
+    };
+    queue_full_policy = queue_full_policy_from_env();
+    pool = threadpool_create(&config, serve_handler_connection, (void*)handler);
+    char* pool_queue = getenv("POOL_QUEUE");
+    printf("Pool of %d threads, %s queue of %d\n", config.num_threads, pool_queue ? pool_queue : "STEAL",
+           config.queue_size);
+  }
+
+  // Otherwise every connection gets its own thread. Up to THREAD_CACHE
+  // finished threads are kept for reuse, so connection churn doesn't mean
+  // thread churn, and STACK_SIZE_KB shrinks the address space reserved for
+  // their stacks (e.g. 64) so more of them fit in a 32-bit process.
+  // MAX_CONNECTIONS bounds the number of these threads; OVERLOAD picks
+  // between pausing accept and rejecting the excess.
+  threadcache_t* cache = NULL;
+  if (!pool) {
+    admission_init_from_env(&admission, 0);
+    int max_idle = getenv_int("THREAD_CACHE", 64);
+    int stack_size_kb = getenv_int("STACK_SIZE_KB", 0);
+    cache = threadcache_create(max_idle, (size_t)stack_size_kb * 1024, serve_admitted_connection, (void*)handler);
+    if (stack_size_kb > 0) {
+      printf("Thread per connection, caching %d threads with %d KiB stack reservations\n", max_idle, stack_size_kb);
+    } else {
+      printf("Thread per connection, caching %d threads\n", max_idle);
+    }
+  }
+
   while (1) {
+    if (cache) {
+      admission_wait_for_room(&admission);
+    }
+
     struct sockaddr_in peer_addr;
     socklen_t peer_addr_len = sizeof(peer_addr);
 
@@ -93,16 +277,30 @@ int main(int argc, char** argv) {
     printf("newSockFd: %d\n", newSockFd);
 
     report_peer_connected(&peer_addr, peer_addr_len);
-    pthread_t the_thread;
 
-    thread_config_t* thread_config = (thread_config_t*)malloc(sizeof(*thread_config));
-    if (!thread_config) {
-      die("OOM");
+    if (pool) {
+      if (!threadpool_submit(pool, newSockFd, queue_full_policy == QUEUE_FULL_BLOCK)) {
+        printf("[MAIN-LOOP] queue full, turning away %d\n", newSockFd);
+        if (queue_full_policy == QUEUE_FULL_REJECT) {
+          admission_reject(newSockFd);
+        } else {
+          closesocket(newSockFd);
+        }
+      }
+      continue;
     }
-    thread_config->sockfd = newSockFd;
-    pthread_create(&the_thread, NULL, server_thread, thread_config);
 
-    pthread_detach(the_thread);
+    if (!admission_try_enter(&admission)) {
+      printf("[MAIN-LOOP] at MAX_CONNECTIONS, turning away %d\n", newSockFd);
+      admission_reject(newSockFd);
+      continue;
+    }
+    if (!threadcache_run(cache, newSockFd)) {
+      printf("[MAIN-LOOP] no thread for %d, closing\n", newSockFd);
+      admission_leave(&admission);
+      admission_reject(newSockFd);
+      continue;
+    }
 
     printf("[MAIN-LOOP] PEERING DONE!!!\n");
   }
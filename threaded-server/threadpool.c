@@ -0,0 +1,315 @@
+#include "threadpool.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpsc-ring.h"
+#include "utils.h"
+
+typedef struct {
+  int sockfd;
+  uint64_t queued_at;
+} pending_conn_t;
+
+// Circular queue of connections waiting for a worker, served oldest first by
+// its owner and by thieves alike. Connections are spread round-robin rather
+// than pushed by the worker that will serve them, so there's no locality for
+// taking the newest to preserve, and FIFO bounds how long any one waits.
+typedef struct {
+  pending_conn_t* items;
+  int capacity;
+  int head;
+  int count;
+} conn_deque_t;
+
+typedef struct {
+  uint64_t served;
+  uint64_t stolen;
+  uint64_t wait_ns_total;
+  uint64_t wait_ns_max;
+  uint64_t serve_ns_total;
+  uint64_t serve_ns_max;
+} worker_stats_t;
+
+// Per-worker state. With work stealing every worker has its own deque and
+// lock; with the shared queue they all use workers[0]'s; with rings only ring
+// is used.
+typedef struct {
+  threadpool_t* pool;
+  int index;
+  pthread_mutex_t lock;
+  conn_deque_t deque;
+  mpsc_ring_t* ring;
+  // Connections queued on ring or being served; picks the target of submit.
+  atomic_int load;
+  // Guarded by lock.
+  worker_stats_t stats;
+} worker_t;
+
+struct threadpool {
+  threadpool_config_t config;
+  threadpool_serve_fn serve;
+  void* arg;
+  worker_t* workers;
+
+  // Connections queued across all deques; bounded by config.queue_size.
+  atomic_int queued;
+  atomic_uint next_victim;
+  atomic_ullong rejected;
+
+  // Idle workers sleep on has_work; a full queue blocks the acceptor on
+  // not_full. Both only matter at the edges (no work / too much work), so
+  // the busy path never touches these locks.
+  pthread_mutex_t idle_lock;
+  pthread_cond_t has_work;
+  atomic_int num_idle;
+  pthread_mutex_t full_lock;
+  pthread_cond_t not_full;
+};
+
+static void deque_init(conn_deque_t* deque, int capacity) {
+  deque->items = (pending_conn_t*)xmalloc(sizeof(pending_conn_t) * capacity);
+  deque->capacity = capacity;
+  deque->head = 0;
+  deque->count = 0;
+}
+
+static void deque_push(conn_deque_t* deque, pending_conn_t conn) {
+  deque->items[(deque->head + deque->count) % deque->capacity] = conn;
+  deque->count++;
+}
+
+static pending_conn_t deque_take_oldest(conn_deque_t* deque) {
+  pending_conn_t conn = deque->items[deque->head];
+  deque->head = (deque->head + 1) % deque->capacity;
+  deque->count--;
+  return conn;
+}
+
+// Takes a connection from worker's own deque, or failing that steals one from
+// another worker. Returns false if there was nothing to take.
+static bool take_conn(worker_t* worker, pending_conn_t* conn, bool* stolen) {
+  threadpool_t* pool = worker->pool;
+  bool work_stealing = pool->config.queue == THREADPOOL_WORK_STEALING;
+  worker_t* own = work_stealing ? worker : &pool->workers[0];
+
+  pthread_mutex_lock(&own->lock);
+  bool found = own->deque.count > 0;
+  if (found) *conn = deque_take_oldest(&own->deque);
+  pthread_mutex_unlock(&own->lock);
+  *stolen = false;
+  if (found || !work_stealing) return found;
+
+  int num_threads = pool->config.num_threads;
+  for (int i = 1; i < num_threads && !found; i++) {
+    worker_t* victim = &pool->workers[(worker->index + i) % num_threads];
+    // Peek without the lock first so idle workers don't hammer busy ones.
+    if (__atomic_load_n(&victim->deque.count, __ATOMIC_RELAXED) == 0) continue;
+    pthread_mutex_lock(&victim->lock);
+    found = victim->deque.count > 0;
+    if (found) *conn = deque_take_oldest(&victim->deque);
+    pthread_mutex_unlock(&victim->lock);
+  }
+  *stolen = found;
+  return found;
+}
+
+static void* worker_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  threadpool_t* pool = worker->pool;
+  while (1) {
+    pending_conn_t conn;
+    bool stolen = false;
+    if (worker->ring) {
+      if (!mpsc_ring_pop(worker->ring, &conn)) {
+        mpsc_ring_wait(worker->ring);
+        continue;
+      }
+    } else if (!take_conn(worker, &conn, &stolen)) {
+      pthread_mutex_lock(&pool->idle_lock);
+      atomic_fetch_add(&pool->num_idle, 1);
+      // Re-checked under idle_lock: a submit that raced with the failed take
+      // either sees num_idle and signals after we wait, or is seen here.
+      if (atomic_load(&pool->queued) == 0) {
+        pthread_cond_wait(&pool->has_work, &pool->idle_lock);
+      }
+      atomic_fetch_sub(&pool->num_idle, 1);
+      pthread_mutex_unlock(&pool->idle_lock);
+      continue;
+    }
+
+    if (atomic_fetch_sub(&pool->queued, 1) == pool->config.queue_size) {
+      pthread_mutex_lock(&pool->full_lock);
+      pthread_cond_signal(&pool->not_full);
+      pthread_mutex_unlock(&pool->full_lock);
+    }
+
+    uint64_t started_at = monotonic_ns();
+    pool->serve(conn.sockfd, pool->arg);
+    uint64_t done_at = monotonic_ns();
+    if (worker->ring) atomic_fetch_sub(&worker->load, 1);
+
+    uint64_t wait_ns = started_at - conn.queued_at;
+    uint64_t serve_ns = done_at - started_at;
+    pthread_mutex_lock(&worker->lock);
+    worker_stats_t* stats = &worker->stats;
+    stats->served++;
+    stats->stolen += stolen;
+    stats->wait_ns_total += wait_ns;
+    if (wait_ns > stats->wait_ns_max) stats->wait_ns_max = wait_ns;
+    stats->serve_ns_total += serve_ns;
+    if (serve_ns > stats->serve_ns_max) stats->serve_ns_max = serve_ns;
+    pthread_mutex_unlock(&worker->lock);
+  }
+  return 0;
+}
+
+static void* stats_thread(void* arg) {
+  threadpool_t* pool = (threadpool_t*)arg;
+  while (1) {
+    Sleep(pool->config.stats_interval_ms);
+
+    worker_stats_t total = {0};
+    for (int i = 0; i < pool->config.num_threads; i++) {
+      worker_t* worker = &pool->workers[i];
+      pthread_mutex_lock(&worker->lock);
+      worker_stats_t* stats = &worker->stats;
+      total.served += stats->served;
+      total.stolen += stats->stolen;
+      total.wait_ns_total += stats->wait_ns_total;
+      if (stats->wait_ns_max > total.wait_ns_max) total.wait_ns_max = stats->wait_ns_max;
+      total.serve_ns_total += stats->serve_ns_total;
+      if (stats->serve_ns_max > total.serve_ns_max) total.serve_ns_max = stats->serve_ns_max;
+      *stats = (worker_stats_t){0};
+      pthread_mutex_unlock(&worker->lock);
+    }
+    uint64_t rejected = atomic_exchange(&pool->rejected, 0);
+    int queued = atomic_load(&pool->queued);
+
+    if (total.served == 0 && rejected == 0 && queued == 0) {
+      continue;
+    }
+    uint64_t served = total.served;
+    printf("[POOL-STATS] %.1f conn/s, %" PRIu64 " stolen, %" PRIu64 " rejected, %d queued; queue wait avg %" PRIu64
+           " us max %" PRIu64 " us; serve avg %" PRIu64 " us max %" PRIu64 " us\n",
+           served * 1000.0 / pool->config.stats_interval_ms, total.stolen, rejected, queued,
+           served ? total.wait_ns_total / served / 1000 : 0, total.wait_ns_max / 1000,
+           served ? total.serve_ns_total / served / 1000 : 0, total.serve_ns_max / 1000);
+  }
+  return 0;
+}
+
+threadpool_t* threadpool_create(const threadpool_config_t* config, threadpool_serve_fn serve, void* arg) {
+  if (config->num_threads < 1 || config->queue_size < 1) {
+    die("threadpool needs at least 1 thread (got %d) and a queue of 1 (got %d)", config->num_threads,
+        config->queue_size);
+  }
+
+  threadpool_t* pool = (threadpool_t*)xmalloc(sizeof(*pool));
+  pool->config = *config;
+  pool->serve = serve;
+  pool->arg = arg;
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->next_victim, 0);
+  atomic_init(&pool->rejected, 0);
+  atomic_init(&pool->num_idle, 0);
+  pthread_mutex_init(&pool->idle_lock, NULL);
+  pthread_cond_init(&pool->has_work, NULL);
+  pthread_mutex_init(&pool->full_lock, NULL);
+  pthread_cond_init(&pool->not_full, NULL);
+
+  pool->workers = (worker_t*)xmalloc(sizeof(worker_t) * config->num_threads);
+  for (int i = 0; i < config->num_threads; i++) {
+    worker_t* worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->stats = (worker_stats_t){0};
+    atomic_init(&worker->load, 0);
+    // Any single deque or ring may have to hold the whole queue.
+    worker->deque = (conn_deque_t){0};
+    worker->ring = NULL;
+    if (config->queue == THREADPOOL_RINGS) {
+      worker->ring = mpsc_ring_create(config->queue_size, sizeof(pending_conn_t));
+    } else if (i == 0 || config->queue == THREADPOOL_WORK_STEALING) {
+      deque_init(&worker->deque, config->queue_size);
+    }
+  }
+
+  for (int i = 0; i < config->num_threads; i++) {
+    pthread_t the_thread;
+    if (pthread_create(&the_thread, NULL, worker_thread, &pool->workers[i]) != 0) {
+      die("pthread_create failed for worker %d", i);
+    }
+    pthread_detach(the_thread);
+  }
+  if (config->stats_interval_ms > 0) {
+    pthread_t the_thread;
+    if (pthread_create(&the_thread, NULL, stats_thread, pool) != 0) {
+      die("pthread_create failed for stats thread");
+    }
+    pthread_detach(the_thread);
+  }
+  return pool;
+}
+
+bool threadpool_submit(threadpool_t* pool, int sockfd, bool block) {
+  // Reserve a slot in the bound first, so queued never exceeds queue_size.
+  int queued = atomic_load(&pool->queued);
+  do {
+    if (queued >= pool->config.queue_size) {
+      if (!block) {
+        atomic_fetch_add(&pool->rejected, 1);
+        return false;
+      }
+      pthread_mutex_lock(&pool->full_lock);
+      while (atomic_load(&pool->queued) >= pool->config.queue_size) {
+        pthread_cond_wait(&pool->not_full, &pool->full_lock);
+      }
+      pthread_mutex_unlock(&pool->full_lock);
+      queued = atomic_load(&pool->queued);
+    }
+  } while (queued >= pool->config.queue_size ||
+           !atomic_compare_exchange_weak(&pool->queued, &queued, queued + 1));
+
+  pending_conn_t conn = {sockfd, monotonic_ns()};
+  if (pool->config.queue == THREADPOOL_RINGS) {
+    // Least loaded worker; the scan starts round-robin so ties spread out.
+    int num_threads = pool->config.num_threads;
+    int start = atomic_fetch_add(&pool->next_victim, 1) % num_threads;
+    worker_t* target = &pool->workers[start];
+    int target_load = atomic_load(&target->load);
+    for (int i = 1; i < num_threads && target_load > 0; i++) {
+      worker_t* worker = &pool->workers[(start + i) % num_threads];
+      int load = atomic_load(&worker->load);
+      if (load < target_load) {
+        target = worker;
+        target_load = load;
+      }
+    }
+    atomic_fetch_add(&target->load, 1);
+    // Can't fail: the ring holds queue_size and we reserved a slot above.
+    mpsc_ring_push(target->ring, &conn);
+    return true;
+  }
+
+  // Spread connections over the workers' deques; whoever is idle steals.
+  worker_t* target = &pool->workers[0];
+  if (pool->config.queue == THREADPOOL_WORK_STEALING) {
+    target = &pool->workers[atomic_fetch_add(&pool->next_victim, 1) % pool->config.num_threads];
+  }
+  pthread_mutex_lock(&target->lock);
+  deque_push(&target->deque, conn);
+  pthread_mutex_unlock(&target->lock);
+
+  if (atomic_load(&pool->num_idle) > 0) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+  return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+
+// A fixed set of pre-spawned worker threads serving accepted connections from
+// a bounded queue: the C counterpart of threadpool-server.py.
+//
+// How pending connections reach the workers is set by threadpool_queue_t.
+
+typedef struct threadpool threadpool_t;
+
+// Serves one connection to completion on a worker thread.
+typedef void (*threadpool_serve_fn)(int sockfd, void* arg);
+
+typedef enum {
+  // Every worker has its own queue of pending connections, fed round-robin
+  // and served oldest first, and a worker whose queue runs dry steals the
+  // oldest from the others; submitting and taking only contend on one
+  // worker's lock instead of a pool-wide one.
+  THREADPOOL_WORK_STEALING,
+  // One queue shared by all workers, behind a single lock.
+  THREADPOOL_SHARED,
+  // Every worker consumes its own lock-free ring (utils/mpsc-ring.h), and
+  // submit picks the worker with the fewest connections queued or in service.
+  // No locks on either side and no stealing.
+  THREADPOOL_RINGS,
+} threadpool_queue_t;
+
+typedef struct {
+  int num_threads;
+  // At most this many connections wait for a worker, across all queues.
+  int queue_size;
+  threadpool_queue_t queue;
+  // If > 0, throughput and latency stats are printed this often.
+  int stats_interval_ms;
+} threadpool_config_t;
+
+// Spawns config->num_threads workers calling serve(sockfd, arg) for every
+// queued connection.
+threadpool_t* threadpool_create(const threadpool_config_t* config, threadpool_serve_fn serve, void* arg);
+
+// Queues sockfd for a worker. When the queue is full, waits for room if block
+// is set, and otherwise returns false without queueing sockfd (it's up to the
+// caller to reject or close it).
+bool threadpool_submit(threadpool_t* pool, int sockfd, bool block);
@@ -0,0 +1,59 @@
+#include "admission.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void admission_init_from_env(admission_t* admission, int default_max_active) {
+  admission->max_active = getenv_int("MAX_CONNECTIONS", default_max_active);
+  char* policy = getenv("OVERLOAD");
+  if (!policy || !strcmp(policy, "PAUSE")) {
+    admission->policy = OVERLOAD_PAUSE;
+  } else if (!strcmp(policy, "REJECT")) {
+    admission->policy = OVERLOAD_REJECT;
+  } else {
+    die("unknown OVERLOAD: %s", policy);
+  }
+  admission->active = 0;
+  InitializeSRWLock(&admission->lock);
+  InitializeConditionVariable(&admission->has_room);
+}
+
+static bool is_full(const admission_t* admission) {
+  return admission->max_active > 0 && admission->active >= admission->max_active;
+}
+
+bool admission_paused(admission_t* admission) {
+  AcquireSRWLockExclusive(&admission->lock);
+  bool paused = admission->policy == OVERLOAD_PAUSE && is_full(admission);
+  ReleaseSRWLockExclusive(&admission->lock);
+  return paused;
+}
+
+void admission_wait_for_room(admission_t* admission) {
+  AcquireSRWLockExclusive(&admission->lock);
+  while (admission->policy == OVERLOAD_PAUSE && is_full(admission)) {
+    SleepConditionVariableSRW(&admission->has_room, &admission->lock, INFINITE, 0);
+  }
+  ReleaseSRWLockExclusive(&admission->lock);
+}
+
+bool admission_try_enter(admission_t* admission) {
+  AcquireSRWLockExclusive(&admission->lock);
+  bool admitted = !is_full(admission);
+  if (admitted) admission->active++;
+  ReleaseSRWLockExclusive(&admission->lock);
+  return admitted;
+}
+
+void admission_leave(admission_t* admission) {
+  AcquireSRWLockExclusive(&admission->lock);
+  admission->active--;
+  ReleaseSRWLockExclusive(&admission->lock);
+  WakeConditionVariable(&admission->has_room);
+}
+
+void admission_reject(int sockfd) {
+  make_socket_non_blocking(sockfd);
+  send(sockfd, OVERLOAD_MESSAGE, sizeof(OVERLOAD_MESSAGE) - 1, 0);
+  closesocket(sockfd);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sent to connections turned away because the server is overloaded.
+#define OVERLOAD_MESSAGE "BUSY\n"
+
+typedef enum {
+  // Stop accepting while at the limit; the excess waits in the listen backlog.
+  OVERLOAD_PAUSE,
+  // Keep accepting, answer the excess with OVERLOAD_MESSAGE and close it.
+  OVERLOAD_REJECT,
+} overload_policy_t;
+
+// Admission control for an engine's accept loop: bounds the number of
+// connections served at once, so overload sheds or queues connections instead
+// of exhausting threads or descriptors. Safe to share between threads.
+typedef struct {
+  // 0 for no limit.
+  int max_active;
+  overload_policy_t policy;
+  int active;
+  SRWLOCK lock;
+  CONDITION_VARIABLE has_room;
+} admission_t;
+
+// Initializes admission from the MAX_CONNECTIONS environment variable
+// (default_max_active when unset, 0 for no limit) and OVERLOAD (PAUSE, the
+// default, or REJECT); dies on an unknown policy.
+void admission_init_from_env(admission_t* admission, int default_max_active);
+
+// True when the engine should stop accepting for now: the limit is reached
+// and the policy is OVERLOAD_PAUSE. For event loops, which drop interest in
+// the listening socket meanwhile.
+bool admission_paused(admission_t* admission);
+
+// Blocks while admission_paused. For engines that accept on a thread of their
+// own.
+void admission_wait_for_room(admission_t* admission);
+
+// Counts a just-accepted connection in. Returns false if that would exceed the
+// limit; the caller should then admission_reject it.
+bool admission_try_enter(admission_t* admission);
+
+// Counts a connection out when it closes; once for every admitted one.
+void admission_leave(admission_t* admission);
+
+// Sends OVERLOAD_MESSAGE to sockfd without blocking, as far as the socket
+// buffer takes it, and closes sockfd.
+void admission_reject(int sockfd);
+
+#ifdef __cplusplus
+}
+#endif
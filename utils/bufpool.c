@@ -0,0 +1,39 @@
+#include "bufpool.h"
+
+#include <assert.h>
+
+#include "utils.h"
+
+void bufpool_init(bufpool_t* pool, size_t buffer_size, int slab_buffers) {
+  assert(buffer_size >= sizeof(void*) && slab_buffers > 0);
+  // Keep every buffer in a slab pointer-aligned.
+  pool->buffer_size = (buffer_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  pool->slab_buffers = slab_buffers;
+  pool->free_buffers = NULL;
+  pool->allocated = 0;
+  pool->attached = 0;
+}
+
+void* bufpool_get(bufpool_t* pool) {
+  if (!pool->free_buffers) {
+    char* slab = (char*)xmalloc(pool->buffer_size * pool->slab_buffers);
+    // Chained so that they're handed out in address order.
+    for (int i = pool->slab_buffers - 1; i >= 0; i--) {
+      void* buffer = &slab[pool->buffer_size * i];
+      *(void**)buffer = pool->free_buffers;
+      pool->free_buffers = buffer;
+    }
+    pool->allocated += pool->slab_buffers;
+  }
+  // A free buffer's first bytes link it to the next one.
+  void* buffer = pool->free_buffers;
+  pool->free_buffers = *(void**)buffer;
+  pool->attached++;
+  return buffer;
+}
+
+void bufpool_put(bufpool_t* pool, void* buffer) {
+  *(void**)buffer = pool->free_buffers;
+  pool->free_buffers = buffer;
+  pool->attached--;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pool of fixed-size buffers that engines lend to a connection only while it
+// has data in flight, so that idle connections hold none. Buffers are carved
+// out of slabs and handed out most recently returned first, while they're
+// still likely cached; slabs are kept for the life of the process.
+//
+// Not thread-safe: meant to be owned by a single event loop.
+typedef struct {
+  size_t buffer_size;
+  int slab_buffers;
+  void* free_buffers;
+  // Buffers carved out so far, and how many of them are lent out.
+  int allocated;
+  int attached;
+} bufpool_t;
+
+// Initializes an empty pool of buffer_size-byte buffers (at least the size of
+// a pointer), allocated slab_buffers at a time.
+void bufpool_init(bufpool_t* pool, size_t buffer_size, int slab_buffers);
+
+// Lends out a buffer, allocating a slab if none is free.
+void* bufpool_get(bufpool_t* pool);
+
+// Returns a buffer obtained from bufpool_get.
+void bufpool_put(bufpool_t* pool, void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,208 @@
+#pragma once
+
+// C++20 coroutine counterpart of the fibers in coroutine-server.c: connection
+// code is a stackless coroutine that co_awaits socket operations, and a
+// single-threaded poll_reactor resumes it once the operation can complete.
+//
+//   sv::task serve(sv::poll_reactor& reactor, int sockfd) {
+//     char buf[1024];
+//     int n = co_await sv::async_recv(reactor, sockfd, buf, sizeof(buf));
+//     ...
+//   }
+//
+// Operations are tried at once and only suspend the coroutine when the socket
+// would block; the reactor retries them when WSAPoll reports readiness, so a
+// co_await always produces the result of a completed recv/send/accept.
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <vector>
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "utils.h"
+
+namespace sv {
+
+// Per-thread free lists for coroutine frames, in 64-byte size classes. A
+// connection's frame is recycled for the next one instead of going through the
+// allocator; frames above max_pooled_size fall back to operator new.
+class frame_pool {
+ public:
+  static constexpr size_t granularity = 64;
+  static constexpr size_t max_pooled_size = 4096;
+
+  static void* allocate(size_t size) {
+    size_t size_class = (size + granularity - 1) / granularity;
+    if (size_class * granularity > max_pooled_size) return ::operator new(size);
+    free_frame*& head = free_lists_[size_class];
+    if (head) {
+      free_frame* frame = head;
+      head = frame->next;
+      return frame;
+    }
+    if (!seen_[size_class]) {
+      // Reports the frame sizes in use, which is what the pool costs.
+      seen_[size_class] = true;
+      printf("[FRAME-POOL] allocating %zu-byte frames for %zu-byte coroutines\n", size_class * granularity, size);
+    }
+    return ::operator new(size_class * granularity);
+  }
+
+  static void deallocate(void* p, size_t size) {
+    size_t size_class = (size + granularity - 1) / granularity;
+    if (size_class * granularity > max_pooled_size) {
+      ::operator delete(p);
+      return;
+    }
+    free_frame* frame = static_cast<free_frame*>(p);
+    frame->next = free_lists_[size_class];
+    free_lists_[size_class] = frame;
+  }
+
+ private:
+  struct free_frame {
+    free_frame* next;
+  };
+  static constexpr size_t num_classes = max_pooled_size / granularity + 1;
+  static inline thread_local free_frame* free_lists_[num_classes] = {};
+  static inline thread_local bool seen_[num_classes] = {};
+};
+
+// A fire-and-forget coroutine: starts running when called and frees its frame
+// when it returns. Connection and acceptor coroutines are tasks.
+struct task {
+  struct promise_type {
+    task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void* operator new(size_t size) { return frame_pool::allocate(size); }
+    static void operator delete(void* p, size_t size) { frame_pool::deallocate(p, size); }
+  };
+};
+
+// A socket operation a coroutine waits on: perform() attempts it and returns
+// false if the socket would block.
+struct io_op {
+  int sockfd;
+  // POLLRDNORM or POLLWRNORM: what to wait for before retrying.
+  short events;
+  bool (*perform)(io_op* op);
+  std::coroutine_handle<> waiter;
+};
+
+// Single-threaded reactor over WSAPoll, resuming coroutines whose pending
+// io_op completed.
+class poll_reactor {
+ public:
+  void wait(io_op* op) { waiting_.push_back(op); }
+
+  // Polls and resumes coroutines until nothing is waiting any more.
+  void run() {
+    while (!waiting_.empty()) {
+      pollfds_.resize(waiting_.size());
+      for (size_t i = 0; i < waiting_.size(); i++) {
+        pollfds_[i].fd = waiting_[i]->sockfd;
+        pollfds_[i].events = waiting_[i]->events;
+        pollfds_[i].revents = 0;
+      }
+      if (WSAPoll(pollfds_.data(), (ULONG)pollfds_.size(), -1) == SOCKET_ERROR) {
+        perror_die("[POLL-REACTOR] WSAPoll error");
+      }
+
+      // Split the completed operations off before resuming any: resumed
+      // coroutines may start waiting again.
+      completed_.clear();
+      size_t still_waiting = 0;
+      size_t num_polled = pollfds_.size();
+      for (size_t i = 0; i < num_polled; i++) {
+        io_op* op = waiting_[i];
+        // Errors and hangups retry the operation too, which reports them.
+        if (pollfds_[i].revents && op->perform(op)) {
+          completed_.push_back(op);
+        } else {
+          waiting_[still_waiting++] = op;
+        }
+      }
+      waiting_.resize(still_waiting);
+      for (io_op* op : completed_) op->waiter.resume();
+    }
+  }
+
+ private:
+  std::vector<io_op*> waiting_;
+  std::vector<io_op*> completed_;
+  std::vector<WSAPOLLFD> pollfds_;
+};
+
+// Awaitable io_op: completes at once if it can, otherwise suspends the
+// awaiting coroutine on the reactor.
+template <typename Op>
+struct io_awaitable : io_op {
+  poll_reactor& reactor;
+  int result = 0;
+
+  io_awaitable(poll_reactor& reactor, int sockfd, short events) : io_op{sockfd, events, &Op::attempt, {}}, reactor(reactor) {}
+
+  bool await_ready() { return Op::attempt(this); }
+  void await_suspend(std::coroutine_handle<> handle) {
+    waiter = handle;
+    reactor.wait(this);
+  }
+  int await_resume() const { return result; }
+
+ protected:
+  // Stores n as the result unless the call would have blocked.
+  bool complete(int n) {
+    if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return false;
+    result = n;
+    return true;
+  }
+};
+
+// co_await yields what a blocking recv would have returned.
+struct async_recv : io_awaitable<async_recv> {
+  void* buf;
+  int len;
+
+  async_recv(poll_reactor& reactor, int sockfd, void* buf, int len)
+      : io_awaitable(reactor, sockfd, POLLRDNORM), buf(buf), len(len) {}
+
+  static bool attempt(io_op* op) {
+    auto* self = static_cast<async_recv*>(op);
+    return self->complete(recv(self->sockfd, (char*)self->buf, self->len, 0));
+  }
+};
+
+// co_await yields what a blocking send would have returned; like send, it may
+// send less than len bytes.
+struct async_send : io_awaitable<async_send> {
+  const void* buf;
+  int len;
+
+  async_send(poll_reactor& reactor, int sockfd, const void* buf, int len)
+      : io_awaitable(reactor, sockfd, POLLWRNORM), buf(buf), len(len) {}
+
+  static bool attempt(io_op* op) {
+    auto* self = static_cast<async_send*>(op);
+    return self->complete(send(self->sockfd, (const char*)self->buf, self->len, 0));
+  }
+};
+
+// co_await yields the accepted socket, or SOCKET_ERROR. The listening socket
+// must be non-blocking.
+struct async_accept : io_awaitable<async_accept> {
+  async_accept(poll_reactor& reactor, int listen_sockfd) : io_awaitable(reactor, listen_sockfd, POLLRDNORM) {}
+
+  static bool attempt(io_op* op) {
+    auto* self = static_cast<async_accept*>(op);
+    return self->complete((int)accept(self->sockfd, NULL, NULL));
+  }
+};
+
+}  // namespace sv
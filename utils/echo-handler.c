@@ -0,0 +1,54 @@
+#include <stdlib.h>
+
+#include "echo-scan.h"
+#include "handler.h"
+#include "utils.h"
+
+typedef struct {
+  ProcessingState state;
+} echo_conn_t;
+
+// The scanner named by the ECHO_SCAN environment variable; simd unless set
+// (see bench/protocol-bench for how the variants compare).
+static echo_scan_fn echo_scan(void) {
+  static echo_scan_fn scan = NULL;
+  if (!scan) {
+    char* name = getenv("ECHO_SCAN");
+    echo_scan_fn found = find_echo_scan(name ? name : "simd");
+    if (!found) {
+      die("unknown ECHO_SCAN: %s", name);
+    }
+    scan = found;
+  }
+  return scan;
+}
+
+static void* echo_on_connect(handler_out_t* out) {
+  echo_conn_t* conn = (echo_conn_t*)xmalloc(sizeof(*conn));
+  conn->state = WAIT_FOR_MSG;
+  handler_out_push(out, '*');
+  return conn;
+}
+
+static int echo_on_data(void* arg, const uint8_t* data, int len, handler_out_t* out) {
+  echo_conn_t* conn = (echo_conn_t*)arg;
+  out->frames += echo_scan()(&conn->state, data, len, out);
+  return len;
+}
+
+static void echo_on_close(void* conn) {
+  free(conn);
+}
+
+static bool echo_in_frame(void* arg) {
+  return ((echo_conn_t*)arg)->state == IN_MSG;
+}
+
+const handler_t echo_handler = {
+    .name = "echo",
+    .on_connect = echo_on_connect,
+    .on_data = echo_on_data,
+    .on_writable = NULL,
+    .on_close = echo_on_close,
+    .in_frame = echo_in_frame,
+};
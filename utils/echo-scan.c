@@ -0,0 +1,143 @@
+#include "echo-scan.h"
+
+#include <emmintrin.h>
+#include <string.h>
+
+int echo_scan_scalar(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out) {
+  int frames = 0;
+  for (int i = 0; i < len; i++) {
+    switch (*state) {
+      case WAIT_FOR_MSG:
+        if (data[i] == '^') {
+          *state = IN_MSG;
+        }
+        break;
+      case IN_MSG:
+        if (data[i] == '$') {
+          *state = WAIT_FOR_MSG;
+          frames++;
+        } else {
+          handler_out_push(out, data[i] + 1);
+        }
+        break;
+    }
+  }
+  return frames;
+}
+
+// Returns the index of the first byte equal to c in data[from, len), or len.
+static int find_byte(const uint8_t* data, int from, int len, uint8_t c) {
+  const __m128i needle = _mm_set1_epi8((char)c);
+  int i = from;
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)&data[i]);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < len; i++) {
+    if (data[i] == c) {
+      return i;
+    }
+  }
+  return len;
+}
+
+// Appends data[0, len) to out with every byte shifted by 1.
+static void append_shifted(handler_out_t* out, const uint8_t* data, int len) {
+  const __m128i ones = _mm_set1_epi8(1);
+  while (len > 0) {
+    int space;
+    uint8_t* dest = handler_out_reserve(out, &space);
+    int n = space < len ? space : len;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i*)&data[i]);
+      _mm_storeu_si128((__m128i*)&dest[i], _mm_add_epi8(block, ones));
+    }
+    for (; i < n; i++) {
+      dest[i] = data[i] + 1;
+    }
+    handler_out_commit(out, n);
+    data += n;
+    len -= n;
+  }
+}
+
+int echo_scan_simd(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out) {
+  int frames = 0;
+  int i = 0;
+  while (i < len) {
+    if (*state == WAIT_FOR_MSG) {
+      i = find_byte(data, i, len, '^');
+      if (i < len) {
+        *state = IN_MSG;
+        i++;
+      }
+    } else {
+      int end = find_byte(data, i, len, '$');
+      append_shifted(out, &data[i], end - i);
+      i = end;
+      if (i < len) {
+        *state = WAIT_FOR_MSG;
+        frames++;
+        i++;
+      }
+    }
+  }
+  return frames;
+}
+
+// dfa_next[state][byte] is the state after byte; dfa_emit[state][byte] is 1
+// when byte belongs to a frame's payload.
+static uint8_t dfa_next[2][256];
+static uint8_t dfa_emit[2][256];
+static int dfa_ready = 0;
+
+static void init_dfa(void) {
+  for (int c = 0; c < 256; c++) {
+    dfa_next[WAIT_FOR_MSG][c] = c == '^' ? IN_MSG : WAIT_FOR_MSG;
+    dfa_emit[WAIT_FOR_MSG][c] = 0;
+    dfa_next[IN_MSG][c] = c == '$' ? WAIT_FOR_MSG : IN_MSG;
+    dfa_emit[IN_MSG][c] = c != '$';
+  }
+  dfa_ready = 1;
+}
+
+int echo_scan_dfa(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out) {
+  // Filling the tables twice from racing threads is harmless.
+  if (!dfa_ready) {
+    init_dfa();
+  }
+
+  int frames = 0;
+  unsigned s = *state;
+  while (len > 0) {
+    // Every input byte emits at most one output byte, so a run as long as the
+    // reserved room can always be written out unconditionally.
+    int space;
+    uint8_t* dest = handler_out_reserve(out, &space);
+    int n = space < len ? space : len;
+    int emitted = 0;
+    for (int i = 0; i < n; i++) {
+      uint8_t c = data[i];
+      dest[emitted] = c + 1;
+      emitted += dfa_emit[s][c];
+      frames += s == IN_MSG && c == '$';
+      s = dfa_next[s][c];
+    }
+    handler_out_commit(out, emitted);
+    data += n;
+    len -= n;
+  }
+  *state = (ProcessingState)s;
+  return frames;
+}
+
+echo_scan_fn find_echo_scan(const char* name) {
+  if (!strcmp(name, "scalar")) return echo_scan_scalar;
+  if (!strcmp(name, "simd")) return echo_scan_simd;
+  if (!strcmp(name, "dfa")) return echo_scan_dfa;
+  return NULL;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "handler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Interchangeable implementations of the "^...$" protocol's inner loop, used
+// by echo_handler and measured against each other by bench/protocol-bench.
+
+typedef enum {
+  WAIT_FOR_MSG,
+  IN_MSG,
+} ProcessingState;
+
+// Runs the protocol over len bytes of data starting in *state, appends every
+// in-frame byte shifted by 1 to out and leaves the final state in *state.
+// Returns the number of frames closed by a '$'.
+typedef int (*echo_scan_fn)(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out);
+
+// One switch per byte, as in the original servers.
+int echo_scan_scalar(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out);
+
+// SSE2: finds the next '^' or '$' 16 bytes at a time and shifts the frame
+// bytes in between with vector adds.
+int echo_scan_simd(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out);
+
+// Table-driven DFA: next state and whether to emit come from lookup tables,
+// so the per-byte loop has no data-dependent branches.
+int echo_scan_dfa(ProcessingState* state, const uint8_t* data, int len, handler_out_t* out);
+
+// Looks up a scanner by name ("scalar", "simd" or "dfa"); NULL if unknown.
+echo_scan_fn find_echo_scan(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,213 @@
+#include "handler.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static const handler_t* handlers[] = {
+    &echo_handler,
+    &isprime_handler,
+    &lenprefix_handler,
+};
+
+// Drained chunks, shared by all connections and threads.
+static sendbuf_chunk_t* free_chunks = NULL;
+static int num_free_chunks = 0;
+static SRWLOCK free_chunks_lock = SRWLOCK_INIT;
+
+// Drained chunks of the calling thread, once it has opted in with
+// handler_out_use_thread_pool; used without locking.
+static _Thread_local bool use_thread_pool = false;
+static _Thread_local sendbuf_chunk_t* thread_free_chunks = NULL;
+static _Thread_local int thread_num_free_chunks = 0;
+
+void handler_out_use_thread_pool(void) {
+  use_thread_pool = true;
+}
+
+static sendbuf_chunk_t* alloc_chunk(void) {
+  if (use_thread_pool) {
+    sendbuf_chunk_t* chunk = thread_free_chunks;
+    if (chunk) {
+      thread_free_chunks = chunk->next;
+      thread_num_free_chunks--;
+    } else {
+      chunk = (sendbuf_chunk_t*)xmalloc(sizeof(*chunk));
+    }
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    return chunk;
+  }
+
+  AcquireSRWLockExclusive(&free_chunks_lock);
+  sendbuf_chunk_t* chunk = free_chunks;
+  if (chunk) {
+    free_chunks = chunk->next;
+    num_free_chunks--;
+  }
+  ReleaseSRWLockExclusive(&free_chunks_lock);
+
+  if (!chunk) {
+    chunk = (sendbuf_chunk_t*)xmalloc(sizeof(*chunk));
+  }
+  chunk->next = NULL;
+  chunk->start = 0;
+  chunk->end = 0;
+  return chunk;
+}
+
+static void release_chunk(sendbuf_chunk_t* chunk) {
+  if (use_thread_pool) {
+    if (thread_num_free_chunks < SENDBUF_POOL_MAX) {
+      chunk->next = thread_free_chunks;
+      thread_free_chunks = chunk;
+      thread_num_free_chunks++;
+    } else {
+      free(chunk);
+    }
+    return;
+  }
+
+  AcquireSRWLockExclusive(&free_chunks_lock);
+  if (num_free_chunks < SENDBUF_POOL_MAX) {
+    chunk->next = free_chunks;
+    free_chunks = chunk;
+    num_free_chunks++;
+    chunk = NULL;
+  }
+  ReleaseSRWLockExclusive(&free_chunks_lock);
+  free(chunk);
+}
+
+// Releases every chunk of out, staged bytes or not.
+static void release_chain(handler_out_t* out) {
+  while (out->head) {
+    sendbuf_chunk_t* head = out->head;
+    out->head = head->next;
+    release_chunk(head);
+  }
+  out->tail = NULL;
+}
+
+uint8_t* handler_out_reserve(handler_out_t* out, int* space) {
+  sendbuf_chunk_t* tail = out->tail;
+  if (!tail || tail->end == SENDBUF_CHUNK_SIZE) {
+    tail = alloc_chunk();
+    if (out->tail) {
+      out->tail->next = tail;
+    } else {
+      out->head = tail;
+    }
+    out->tail = tail;
+  }
+  *space = SENDBUF_CHUNK_SIZE - tail->end;
+  return &tail->data[tail->end];
+}
+
+void handler_out_commit(handler_out_t* out, int n) {
+  assert(out->tail && out->tail->end + n <= SENDBUF_CHUNK_SIZE);
+  out->tail->end += n;
+  out->len += n;
+  // A reservation nothing was committed to leaves an empty chunk behind; with
+  // nothing else staged, don't keep it attached to an idle connection.
+  if (out->len == 0) {
+    release_chain(out);
+  }
+}
+
+void handler_out_append(handler_out_t* out, const void* data, int len) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    int n;
+    uint8_t* dest = handler_out_reserve(out, &n);
+    if (n > len) n = len;
+    memcpy(dest, p, n);
+    handler_out_commit(out, n);
+    p += n;
+    len -= n;
+  }
+}
+
+void handler_out_push(handler_out_t* out, uint8_t byte) {
+  sendbuf_chunk_t* tail = out->tail;
+  if (tail && tail->end < SENDBUF_CHUNK_SIZE) {
+    tail->data[tail->end++] = byte;
+    out->len++;
+  } else {
+    handler_out_append(out, &byte, 1);
+  }
+}
+
+int handler_out_peek(const handler_out_t* out, const uint8_t** data) {
+  sendbuf_chunk_t* head = out->head;
+  if (!head) {
+    *data = NULL;
+    return 0;
+  }
+  *data = &head->data[head->start];
+  return head->end - head->start;
+}
+
+void handler_out_consume(handler_out_t* out, int n) {
+  assert(n <= out->len);
+  out->len -= n;
+  while (n > 0) {
+    sendbuf_chunk_t* head = out->head;
+    int available = head->end - head->start;
+    if (n < available) {
+      head->start += n;
+      return;
+    }
+    n -= available;
+    out->head = head->next;
+    if (!out->head) out->tail = NULL;
+    release_chunk(head);
+  }
+  // All sent; only an empty reserved tail can be left.
+  if (out->len == 0) {
+    release_chain(out);
+  }
+}
+
+void handler_out_reset(handler_out_t* out) {
+  release_chain(out);
+  out->len = 0;
+  out->frames = 0;
+}
+
+int handler_out_send_all(int sockfd, handler_out_t* out) {
+  while (out->len > 0) {
+    const uint8_t* data;
+    int n = handler_out_peek(out, &data);
+    if (send_all(sockfd, data, n) == SOCKET_ERROR) {
+      return SOCKET_ERROR;
+    }
+    handler_out_consume(out, n);
+  }
+  return 0;
+}
+
+const handler_t* find_handler(const char* name) {
+  for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+    if (!strcmp(handlers[i]->name, name)) {
+      return handlers[i];
+    }
+  }
+  return NULL;
+}
+
+const handler_t* handler_from_env(void) {
+  char* name = getenv("PROTOCOL");
+  if (!name) {
+    return &echo_handler;
+  }
+  const handler_t* handler = find_handler(name);
+  if (!handler) {
+    die("unknown PROTOCOL: %s", name);
+  }
+  return handler;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of one chunk of staged output. Output grows a chunk at a time, so a
+// response of any length can be staged.
+#define SENDBUF_CHUNK_SIZE 4096
+
+// Drained chunks kept for reuse, across all connections.
+#define SENDBUF_POOL_MAX 256
+
+// Returned by on_data to ask the engine to drop the connection.
+#define HANDLER_CLOSE (-1)
+
+typedef struct sendbuf_chunk {
+  struct sendbuf_chunk* next;
+  // data[start, end) is still to be sent.
+  int start;
+  int end;
+  uint8_t data[SENDBUF_CHUNK_SIZE];
+} sendbuf_chunk_t;
+
+// Bytes a handler has staged for sending to its peer: a chain of pooled
+// chunks that grows as the handler appends and shrinks as the engine sends.
+// Zero-initialize before use.
+typedef struct {
+  sendbuf_chunk_t* head;
+  sendbuf_chunk_t* tail;
+  // Total bytes staged and not yet sent.
+  int len;
+  // Frames answered so far on this connection; handlers bump it as each
+  // response is complete, so engines can enforce per-connection budgets
+  // without knowing the protocol.
+  int frames;
+} handler_out_t;
+
+// Appends len bytes from data to the staged output.
+void handler_out_append(handler_out_t* out, const void* data, int len);
+
+// Appends a single byte to the staged output.
+void handler_out_push(handler_out_t* out, uint8_t byte);
+
+// Returns writable room at the end of the staged output, allocating a chunk if
+// the last one is full, and stores its size (at least 1) in *space. Bytes
+// written there are staged by a following handler_out_commit.
+uint8_t* handler_out_reserve(handler_out_t* out, int* space);
+
+// Stages the first n bytes of the room returned by handler_out_reserve. n may
+// be 0; a chunk reserved for nothing is released once no output is staged.
+void handler_out_commit(handler_out_t* out, int n);
+
+// Points *data at the first contiguous run of unsent bytes and returns its
+// length; returns 0 when nothing is staged.
+int handler_out_peek(const handler_out_t* out, const uint8_t** data);
+
+// Drops the first n staged bytes after they were sent, returning drained
+// chunks to the pool.
+void handler_out_consume(handler_out_t* out, int n);
+
+// Drops everything staged; used when a connection goes away.
+void handler_out_reset(handler_out_t* out);
+
+// Makes the calling thread recycle chunks through a pool of its own instead of
+// the locked process-wide one. For long-lived event loop threads that never
+// hand connections to other threads; chunks pooled by a thread are not freed
+// when it exits.
+void handler_out_use_thread_pool(void);
+
+// Sends everything staged in out over a blocking socket, draining it.
+// Returns 0 on success, SOCKET_ERROR otherwise.
+int handler_out_send_all(int sockfd, handler_out_t* out);
+
+// A protocol, decoupled from the I/O model that runs it. Engines (sequential,
+// threaded, select, libuv...) own the sockets and buffers; handlers own the
+// protocol state and only ever see bytes.
+typedef struct {
+  const char* name;
+
+  // Called once per accepted connection. Returns the per-connection state
+  // passed to the other callbacks (may be NULL). Anything appended to out is
+  // sent before the engine reads from the peer.
+  void* (*on_connect)(handler_out_t* out);
+
+  // Called with the received bytes that haven't been consumed yet. Appends
+  // any response to out and returns the number of bytes consumed; engines keep
+  // the rest and present it again, followed by newly received data. Returns
+  // HANDLER_CLOSE to drop the connection.
+  int (*on_data)(void* conn, const uint8_t* data, int len, handler_out_t* out);
+
+  // Called when all staged output has been sent; the handler may stage more.
+  // May be NULL.
+  void (*on_writable)(void* conn, handler_out_t* out);
+
+  // Called once when the connection goes away; releases conn.
+  void (*on_close)(void* conn);
+
+  // Returns whether the handler has consumed the start of a frame and waits
+  // for the rest, for engines that time out peers stalling mid-frame. May be
+  // NULL for handlers that leave partial frames unconsumed, in which case
+  // the engine's leftover bytes tell.
+  bool (*in_frame)(void* conn);
+} handler_t;
+
+// The "^...$" protocol: acks with '*', then echoes every byte inside a
+// ^...$ frame shifted by 1.
+extern const handler_t echo_handler;
+
+// Line protocol: every '\n'-terminated decimal number is answered with
+// "prime\n" or "composite\n".
+extern const handler_t isprime_handler;
+
+// Binary framing: every frame is a 4-byte big-endian payload length followed
+// by that many bytes of arbitrary payload. Frames are echoed back as is, and
+// payloads are forwarded in bulk as they arrive instead of being scanned.
+extern const handler_t lenprefix_handler;
+
+// Returns the handler with the given name, or NULL if there is none.
+const handler_t* find_handler(const char* name);
+
+// Returns the handler named by the PROTOCOL environment variable, echo_handler
+// when it isn't set; dies if the name is unknown.
+const handler_t* handler_from_env(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,50 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "handler.h"
+
+// Naive primality test, iterating all the way to sqrt(n) to find numbers that
+// divide n.
+static bool isprime(uint64_t n) {
+  if (n % 2 == 0) return n == 2 ? true : false;
+
+  for (uint64_t r = 3; r * r <= n; r += 2) {
+    if (n % r == 0) return false;
+  }
+  return true;
+}
+
+static void* isprime_on_connect(handler_out_t* out) {
+  // Stateless: everything needed to answer a request is in its line.
+  return NULL;
+}
+
+static int isprime_on_data(void* conn, const uint8_t* data, int len, handler_out_t* out) {
+  int consumed = 0;
+  const uint8_t* newline;
+  // Answer every complete line; a partial line is left unconsumed until the
+  // rest of it arrives.
+  while ((newline = memchr(data + consumed, '\n', len - consumed)) != NULL) {
+    uint64_t number = 0;
+    for (const uint8_t* p = data + consumed; p < newline && isdigit(*p); p++) {
+      number = number * 10 + (*p - '0');
+    }
+    const char* answer = isprime(number) ? "prime\n" : "composite\n";
+    handler_out_append(out, answer, strlen(answer));
+    out->frames++;
+    consumed = newline - data + 1;
+  }
+  return consumed;
+}
+
+static void isprime_on_close(void* conn) {
+}
+
+const handler_t isprime_handler = {
+    .name = "isprime",
+    .on_connect = isprime_on_connect,
+    .on_data = isprime_on_data,
+    .on_writable = NULL,
+    .on_close = isprime_on_close,
+};
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+
+#include "handler.h"
+#include "utils.h"
+
+#define HEADER_SIZE 4
+
+typedef struct {
+  // Payload bytes of the current frame still to come; 0 between frames.
+  uint32_t remaining;
+} lenprefix_conn_t;
+
+static void* lenprefix_on_connect(handler_out_t* out) {
+  lenprefix_conn_t* conn = (lenprefix_conn_t*)xmalloc(sizeof(*conn));
+  conn->remaining = 0;
+  return conn;
+}
+
+static int lenprefix_on_data(void* arg, const uint8_t* data, int len, handler_out_t* out) {
+  lenprefix_conn_t* conn = (lenprefix_conn_t*)arg;
+  int consumed = 0;
+  while (consumed < len) {
+    if (conn->remaining == 0) {
+      // A header split across reads stays unconsumed until it's complete.
+      if (len - consumed < HEADER_SIZE) break;
+      const uint8_t* header = &data[consumed];
+      conn->remaining = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+      handler_out_append(out, header, HEADER_SIZE);
+      consumed += HEADER_SIZE;
+      if (conn->remaining == 0) out->frames++;
+    } else {
+      // The header says how much payload to expect, so whatever part of it
+      // is here is forwarded in one go, without looking at the bytes.
+      int n = len - consumed;
+      if ((uint32_t)n > conn->remaining) n = conn->remaining;
+      handler_out_append(out, &data[consumed], n);
+      conn->remaining -= n;
+      consumed += n;
+      if (conn->remaining == 0) out->frames++;
+    }
+  }
+  return consumed;
+}
+
+static void lenprefix_on_close(void* conn) {
+  free(conn);
+}
+
+// A header split across reads is left unconsumed, so only a payload counts.
+static bool lenprefix_in_frame(void* arg) {
+  return ((lenprefix_conn_t*)arg)->remaining > 0;
+}
+
+const handler_t lenprefix_handler = {
+    .name = "lenprefix",
+    .on_connect = lenprefix_on_connect,
+    .on_data = lenprefix_on_data,
+    .on_writable = NULL,
+    .on_close = lenprefix_on_close,
+    .in_frame = lenprefix_in_frame,
+};
@@ -0,0 +1,113 @@
+#include "mpsc-ring.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Each slot carries a sequence number telling who may use it next: a slot at
+// position pos is free for the producer claiming pos when seq == pos, and
+// holds a complete item for the consumer when seq == pos + 1 (Vyukov's bounded
+// queue, with the consumer side simplified for a single thread).
+typedef struct {
+  atomic_size_t seq;
+  // Followed by item_size bytes of item.
+} slot_t;
+
+struct mpsc_ring {
+  uint8_t* slots;
+  size_t slot_size;
+  size_t item_size;
+  size_t mask;
+  // Next position to claim, shared by the producers.
+  atomic_size_t tail;
+  // Next position to pop; only touched by the consumer.
+  size_t head;
+  // 1 while the consumer is (about to be) asleep in WaitOnAddress.
+  atomic_int sleeping;
+};
+
+static slot_t* slot_at(mpsc_ring_t* ring, size_t pos) {
+  return (slot_t*)&ring->slots[(pos & ring->mask) * ring->slot_size];
+}
+
+mpsc_ring_t* mpsc_ring_create(int capacity, size_t item_size) {
+  size_t num_slots = 1;
+  while (num_slots < (size_t)capacity) {
+    num_slots *= 2;
+  }
+
+  mpsc_ring_t* ring = (mpsc_ring_t*)xmalloc(sizeof(*ring));
+  ring->item_size = item_size;
+  ring->slot_size = (sizeof(slot_t) + item_size + 7) & ~(size_t)7;
+  ring->slots = (uint8_t*)xmalloc(ring->slot_size * num_slots);
+  ring->mask = num_slots - 1;
+  for (size_t pos = 0; pos < num_slots; pos++) {
+    atomic_init(&slot_at(ring, pos)->seq, pos);
+  }
+  atomic_init(&ring->tail, 0);
+  ring->head = 0;
+  atomic_init(&ring->sleeping, 0);
+  return ring;
+}
+
+bool mpsc_ring_push(mpsc_ring_t* ring, const void* item) {
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  slot_t* slot;
+  while (1) {
+    slot = slot_at(ring, pos);
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The consumer hasn't freed this slot since the last lap: full.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+  memcpy(slot + 1, item, ring->item_size);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+  // Pairs with the fence in mpsc_ring_wait: either the consumer sees this item
+  // before sleeping, or we see it sleeping and wake it.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed) && atomic_exchange(&ring->sleeping, 0)) {
+    WakeByAddressSingle((PVOID)&ring->sleeping);
+  }
+  return true;
+}
+
+static bool ring_has_item(mpsc_ring_t* ring) {
+  return atomic_load_explicit(&slot_at(ring, ring->head)->seq, memory_order_acquire) == ring->head + 1;
+}
+
+bool mpsc_ring_pop(mpsc_ring_t* ring, void* item) {
+  if (!ring_has_item(ring)) {
+    return false;
+  }
+  slot_t* slot = slot_at(ring, ring->head);
+  memcpy(item, slot + 1, ring->item_size);
+  // Free the slot for the producer one lap ahead.
+  atomic_store_explicit(&slot->seq, ring->head + ring->mask + 1, memory_order_release);
+  ring->head++;
+  return true;
+}
+
+void mpsc_ring_wait(mpsc_ring_t* ring) {
+  atomic_store(&ring->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ring_has_item(ring)) {
+    atomic_store(&ring->sleeping, 0);
+    return;
+  }
+  // Returns at once if a producer already cleared sleeping.
+  int asleep = 1;
+  WaitOnAddress((volatile VOID*)&ring->sleeping, &asleep, sizeof(asleep), INFINITE);
+  atomic_store(&ring->sleeping, 0);
+}
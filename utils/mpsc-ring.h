@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bounded lock-free ring of fixed-size items, pushed by any number of threads
+// and popped by exactly one. Producers claim slots with a single atomic
+// compare-and-swap and never block; the consumer sleeps on the ring with
+// WaitOnAddress when it runs dry.
+//
+// Wakeups are batched: only the first push after the consumer went to sleep
+// pays for WakeByAddressSingle, and the consumer pops everything queued before
+// it sleeps again.
+typedef struct mpsc_ring mpsc_ring_t;
+
+// Creates a ring of at least capacity items of item_size bytes each.
+mpsc_ring_t* mpsc_ring_create(int capacity, size_t item_size);
+
+// Copies item into the ring and wakes the consumer if it's asleep. Returns
+// false, without copying, if the ring is full.
+bool mpsc_ring_push(mpsc_ring_t* ring, const void* item);
+
+// Consumer only: copies the oldest item out to item and removes it. Returns
+// false if the ring is empty.
+bool mpsc_ring_pop(mpsc_ring_t* ring, void* item);
+
+// Consumer only: sleeps until the ring may be non-empty. Returns at once if it
+// already is; may also return spuriously, so callers pop in a loop.
+void mpsc_ring_wait(mpsc_ring_t* ring);
+
+#ifdef __cplusplus
+}
+#endif
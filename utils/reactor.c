@@ -0,0 +1,589 @@
+// REACTOR_SELECT_SETSIZE; has to precede winsock2.h.
+#define FD_SETSIZE 1024
+
+#include "reactor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(FD_SETSIZE == REACTOR_SELECT_SETSIZE, "FD_SETSIZE must match REACTOR_SELECT_SETSIZE");
+
+// Completions taken from the port per GetQueuedCompletionStatusEx call.
+#define IOCP_BATCH 64
+
+// Granularity of the reactor's timers.
+#define REACTOR_TIMER_TICK_MS 10
+
+// How often the IOCP backend polls sockets with write interest while there
+// are any. Sockets only wait for writability while their send buffer is full,
+// so this rarely applies.
+#define IOCP_WRITE_POLL_MS 1
+
+typedef struct reactor_entry {
+  // IOCP: the zero-byte WSARecv (or for a listener, its event wait) completes
+  // with this. First, so that a completion's OVERLAPPED* is the entry.
+  OVERLAPPED overlapped;
+  int fd;
+  int interest;
+  reactor_callback_t callback;
+  void* arg;
+  // Cleared by reactor_unregister; the entry itself lives on until nothing
+  // can refer to it any more (see reactor_t::dead).
+  bool registered;
+  // Index in the reactor's pollfds, or -1 when not polled.
+  int poll_index;
+  // REACTOR_SELECT: readiness found by the current select, while collected.
+  int select_events;
+
+  // IOCP only.
+  reactor_t* reactor;
+  // A read or a listener wait is posted and its completion still due.
+  bool in_flight;
+  // Watched through event and wait rather than zero-byte reads.
+  bool listening;
+  HANDLE event;
+  HANDLE wait;
+  // Set by the wait callback once it has posted the completion.
+  volatile LONG signaled;
+
+  // Waiting in the reactor's deferred queue, for deferred_events.
+  bool deferred;
+  int deferred_events;
+  struct reactor_entry* next_deferred;
+
+  struct reactor_entry* next_dead;
+} reactor_entry_t;
+
+typedef struct {
+  const char* name;
+  bool (*add)(reactor_t* reactor, reactor_entry_t* entry);
+  // Called after entry->interest changed.
+  void (*update)(reactor_t* reactor, reactor_entry_t* entry);
+  void (*remove)(reactor_t* reactor, reactor_entry_t* entry);
+  // Waits for readiness once, for up to timeout_ms (-1 for as long as it
+  // takes), and calls the callbacks.
+  void (*poll)(reactor_t* reactor, int timeout_ms);
+} reactor_ops_t;
+
+typedef struct {
+  reactor_entry_t* entry;
+  int events;
+} ready_t;
+
+struct reactor {
+  const reactor_ops_t* ops;
+  volatile bool stopped;
+
+  // entries[fd] for every registered fd, grown to fit the largest.
+  reactor_entry_t** entries;
+  int max_entries;
+  // Unregistered entries, freed after the wakeup that unregistered them so
+  // that readiness collected earlier in it is dropped instead of reaching a
+  // new registration of the same fd. With IOCP an entry also waits here for
+  // its outstanding completion.
+  reactor_entry_t* dead;
+
+  // Calls queued by reactor_defer, oldest first.
+  reactor_entry_t* deferred_head;
+  reactor_entry_t* deferred_tail;
+
+  // REACTOR_SELECT: the sets of fds to watch.
+  fd_set read_set;
+  fd_set write_set;
+  // Registered sockets, all of which may be in a set.
+  int num_selected;
+  // The entries of the sockets a select found ready.
+  reactor_entry_t* select_ready[REACTOR_SELECT_SETSIZE];
+
+  // REACTOR_POLL: every fd with any interest. REACTOR_IOCP: those with write
+  // interest.
+  WSAPOLLFD* pollfds;
+  reactor_entry_t** poll_entries;
+  ready_t* ready;
+  int num_polled;
+  int max_polled;
+
+  // REACTOR_IOCP.
+  HANDLE port;
+
+  timer_wheel_t timers;
+};
+
+// Brings the timers' clock up to date after a wait, before any callback can
+// arm a timer.
+static void wait_returned(reactor_t* reactor) {
+  timer_wheel_set_now(&reactor->timers, monotonic_ns() / 1000000);
+}
+
+// Calls entry's callback with the events it's still interested in, unless it
+// was unregistered meanwhile.
+static void dispatch(reactor_t* reactor, reactor_entry_t* entry, int events) {
+  events &= entry->interest;
+  if (entry->registered && events) {
+    entry->callback(reactor, entry->fd, events, entry->arg);
+  }
+}
+
+// The pollfds array, shared by the poll backend and IOCP write interest.
+
+// Adds, updates or (for events 0) removes entry's pollfd.
+static void pollset_sync(reactor_t* reactor, reactor_entry_t* entry, short events) {
+  if (events == 0) {
+    if (entry->poll_index >= 0) {
+      // Moves the last pollfd into the hole.
+      int last = --reactor->num_polled;
+      reactor->pollfds[entry->poll_index] = reactor->pollfds[last];
+      reactor->poll_entries[entry->poll_index] = reactor->poll_entries[last];
+      reactor->poll_entries[entry->poll_index]->poll_index = entry->poll_index;
+      entry->poll_index = -1;
+    }
+    return;
+  }
+
+  if (entry->poll_index < 0) {
+    if (reactor->num_polled == reactor->max_polled) {
+      reactor->max_polled = reactor->max_polled ? reactor->max_polled * 2 : 64;
+      reactor->pollfds = (WSAPOLLFD*)realloc(reactor->pollfds, sizeof(WSAPOLLFD) * reactor->max_polled);
+      reactor->poll_entries =
+          (reactor_entry_t**)realloc(reactor->poll_entries, sizeof(reactor_entry_t*) * reactor->max_polled);
+      reactor->ready = (ready_t*)realloc(reactor->ready, sizeof(ready_t) * reactor->max_polled);
+      if (!reactor->pollfds || !reactor->poll_entries || !reactor->ready) {
+        die("[REACTOR] out of memory growing to %d sockets", reactor->max_polled);
+      }
+    }
+    entry->poll_index = reactor->num_polled++;
+    reactor->poll_entries[entry->poll_index] = entry;
+    reactor->pollfds[entry->poll_index].fd = entry->fd;
+  }
+  reactor->pollfds[entry->poll_index].events = events;
+  reactor->pollfds[entry->poll_index].revents = 0;
+}
+
+// WSAPolls the pollfds for up to timeout_ms and dispatches what's ready.
+static void pollset_poll(reactor_t* reactor, int timeout_ms) {
+  if (reactor->num_polled == 0) {
+    // WSAPoll fails on an empty array. Nothing is polled e.g. while the
+    // listener is paused and every peer has deferred itself.
+    Sleep(timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+    wait_returned(reactor);
+    return;
+  }
+  if (WSAPoll(reactor->pollfds, reactor->num_polled, timeout_ms) == SOCKET_ERROR) {
+    perror_die("[REACTOR] WSAPoll error");
+  }
+  wait_returned(reactor);
+
+  // Collect first: callbacks reorder the pollfds as they change interest.
+  int num_ready = 0;
+  for (int i = 0; i < reactor->num_polled; i++) {
+    short revents = reactor->pollfds[i].revents;
+    if (!revents) continue;
+    int events = 0;
+    if (revents & POLLRDNORM) events |= REACTOR_READ;
+    if (revents & POLLWRNORM) events |= REACTOR_WRITE;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) events |= REACTOR_READ | REACTOR_WRITE;
+    reactor->ready[num_ready++] = (ready_t){reactor->poll_entries[i], events};
+  }
+  for (int i = 0; i < num_ready; i++) {
+    dispatch(reactor, reactor->ready[i].entry, reactor->ready[i].events);
+  }
+}
+
+static short poll_events(int interest) {
+  return (interest & REACTOR_READ ? POLLRDNORM : 0) | (interest & REACTOR_WRITE ? POLLWRNORM : 0);
+}
+
+// REACTOR_SELECT
+
+static void select_update(reactor_t* reactor, reactor_entry_t* entry) {
+  if (entry->interest & REACTOR_READ) {
+    FD_SET(entry->fd, &reactor->read_set);
+  } else {
+    FD_CLR(entry->fd, &reactor->read_set);
+  }
+  if (entry->interest & REACTOR_WRITE) {
+    FD_SET(entry->fd, &reactor->write_set);
+  } else {
+    FD_CLR(entry->fd, &reactor->write_set);
+  }
+}
+
+static bool select_add(reactor_t* reactor, reactor_entry_t* entry) {
+  // A Winsock fd_set is an array of up to FD_SETSIZE sockets, whatever their
+  // handle values.
+  if (reactor->num_selected == FD_SETSIZE) {
+    return false;
+  }
+  reactor->num_selected++;
+  select_update(reactor, entry);
+  return true;
+}
+
+static void select_remove(reactor_t* reactor, reactor_entry_t* entry) {
+  FD_CLR(entry->fd, &reactor->read_set);
+  FD_CLR(entry->fd, &reactor->write_set);
+  reactor->num_selected--;
+}
+
+// Copies the sockets in src to dst, without the unused rest of the array.
+static void copy_fd_set(fd_set* dst, const fd_set* src) {
+  dst->fd_count = src->fd_count;
+  memcpy(dst->fd_array, src->fd_array, sizeof(src->fd_array[0]) * src->fd_count);
+}
+
+// Adds the entry of each socket in set to the select_ready list, with events.
+static int collect_selected(reactor_t* reactor, const fd_set* set, int events, int num_ready) {
+  for (u_int i = 0; i < set->fd_count; i++) {
+    int fd = (int)set->fd_array[i];
+    reactor_entry_t* entry = fd < reactor->max_entries ? reactor->entries[fd] : NULL;
+    if (!entry) continue;
+    if (!entry->select_events) {
+      reactor->select_ready[num_ready++] = entry;
+    }
+    entry->select_events |= events;
+  }
+  return num_ready;
+}
+
+static void select_poll(reactor_t* reactor, int timeout_ms) {
+  fd_set read_fd_set;
+  fd_set write_fd_set;
+  if (reactor->read_set.fd_count == 0 && reactor->write_set.fd_count == 0) {
+    // select fails with WSAEINVAL when all sets are empty, as they are e.g.
+    // while the listener is paused and every peer has deferred itself.
+    Sleep(timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+    wait_returned(reactor);
+    return;
+  }
+  copy_fd_set(&read_fd_set, &reactor->read_set);
+  copy_fd_set(&write_fd_set, &reactor->write_set);
+
+  struct timeval timeout = {timeout_ms / 1000, timeout_ms % 1000 * 1000};
+  // The first argument is ignored by Winsock.
+  if (select(0, &read_fd_set, &write_fd_set, NULL, timeout_ms < 0 ? NULL : &timeout) == SOCKET_ERROR) {
+    perror_die("[REACTOR] select error");
+  }
+  wait_returned(reactor);
+
+  // select leaves only the ready sockets in the sets, so this is O(ready).
+  // Collect first, so that readiness is dropped for entries unregistered by
+  // an earlier callback, rather than looked up for a new registration.
+  int num_ready = collect_selected(reactor, &read_fd_set, REACTOR_READ, 0);
+  num_ready = collect_selected(reactor, &write_fd_set, REACTOR_WRITE, num_ready);
+  for (int i = 0; i < num_ready; i++) {
+    reactor_entry_t* entry = reactor->select_ready[i];
+    int events = entry->select_events;
+    entry->select_events = 0;
+    dispatch(reactor, entry, events);
+  }
+}
+
+static const reactor_ops_t select_ops = {
+    .name = "select",
+    .add = select_add,
+    .update = select_update,
+    .remove = select_remove,
+    .poll = select_poll,
+};
+
+// REACTOR_POLL
+
+static void poll_update(reactor_t* reactor, reactor_entry_t* entry) {
+  pollset_sync(reactor, entry, poll_events(entry->interest));
+}
+
+static bool poll_add(reactor_t* reactor, reactor_entry_t* entry) {
+  poll_update(reactor, entry);
+  return true;
+}
+
+static void poll_remove(reactor_t* reactor, reactor_entry_t* entry) {
+  pollset_sync(reactor, entry, 0);
+}
+
+static void poll_poll(reactor_t* reactor, int timeout_ms) {
+  pollset_poll(reactor, timeout_ms);
+}
+
+static const reactor_ops_t poll_ops = {
+    .name = "poll",
+    .add = poll_add,
+    .update = poll_update,
+    .remove = poll_remove,
+    .poll = poll_poll,
+};
+
+// REACTOR_IOCP
+
+static VOID CALLBACK on_listener_signaled(PVOID arg, BOOLEAN timed_out) {
+  reactor_entry_t* entry = (reactor_entry_t*)arg;
+  InterlockedExchange(&entry->signaled, 1);
+  PostQueuedCompletionStatus(entry->reactor->port, 0, 0, &entry->overlapped);
+}
+
+// Posts what completes once entry is readable: a zero-byte read, which takes
+// no data but waits for some, or for a listening socket, where that fails, a
+// one-shot wait on its FD_ACCEPT event.
+static void iocp_arm_read(reactor_t* reactor, reactor_entry_t* entry) {
+  entry->in_flight = true;
+  if (!entry->listening) {
+    WSABUF empty = {0, NULL};
+    DWORD flags = 0;
+    memset(&entry->overlapped, 0, sizeof(entry->overlapped));
+    if (WSARecv(entry->fd, &empty, 1, NULL, &flags, &entry->overlapped, NULL) != SOCKET_ERROR ||
+        WSAGetLastError() == WSA_IO_PENDING) {
+      return;
+    }
+    if (WSAGetLastError() != WSAENOTCONN) {
+      // Report it as readable; the callback's recv finds out what's wrong.
+      PostQueuedCompletionStatus(reactor->port, 0, 0, &entry->overlapped);
+      return;
+    }
+    entry->listening = true;
+    entry->event = WSACreateEvent();
+    if (entry->event == WSA_INVALID_EVENT || WSAEventSelect(entry->fd, entry->event, FD_ACCEPT) == SOCKET_ERROR) {
+      perror_die("[REACTOR] WSAEventSelect error");
+    }
+  }
+  entry->signaled = 0;
+  if (!RegisterWaitForSingleObject(&entry->wait, entry->event, on_listener_signaled, entry, INFINITE,
+                                   WT_EXECUTEONLYONCE)) {
+    die("[REACTOR] RegisterWaitForSingleObject failed: %lu", GetLastError());
+  }
+}
+
+static void iocp_update(reactor_t* reactor, reactor_entry_t* entry) {
+  pollset_sync(reactor, entry, entry->interest & REACTOR_WRITE ? POLLWRNORM : 0);
+  if ((entry->interest & REACTOR_READ) && !entry->in_flight) {
+    iocp_arm_read(reactor, entry);
+  }
+}
+
+static bool iocp_add(reactor_t* reactor, reactor_entry_t* entry) {
+  entry->reactor = reactor;
+  // Fails for a socket already tied to a port, which is fine if it's this one.
+  if (!CreateIoCompletionPort((HANDLE)(ULONG_PTR)entry->fd, reactor->port, 0, 0) &&
+      GetLastError() != ERROR_INVALID_PARAMETER) {
+    return false;
+  }
+  iocp_update(reactor, entry);
+  return true;
+}
+
+static void iocp_remove(reactor_t* reactor, reactor_entry_t* entry) {
+  pollset_sync(reactor, entry, 0);
+  if (entry->listening) {
+    if (entry->in_flight) {
+      // Once the wait is gone only a completion it already posted is due.
+      UnregisterWaitEx(entry->wait, INVALID_HANDLE_VALUE);
+      entry->in_flight = entry->signaled;
+    }
+    WSAEventSelect(entry->fd, NULL, 0);
+    WSACloseEvent(entry->event);
+  } else if (entry->in_flight) {
+    // The read completes, cancelled, all the same.
+    CancelIoEx((HANDLE)(ULONG_PTR)entry->fd, &entry->overlapped);
+  }
+}
+
+static void iocp_poll(reactor_t* reactor, int timeout_ms) {
+  OVERLAPPED_ENTRY completions[IOCP_BATCH];
+  ULONG num_completions = 0;
+  if (reactor->num_polled > 0 && (timeout_ms < 0 || timeout_ms > IOCP_WRITE_POLL_MS)) {
+    timeout_ms = IOCP_WRITE_POLL_MS;
+  }
+  DWORD timeout = timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms;
+  if (!GetQueuedCompletionStatusEx(reactor->port, completions, IOCP_BATCH, &num_completions, timeout, FALSE)) {
+    if (GetLastError() != WAIT_TIMEOUT) {
+      die("[REACTOR] GetQueuedCompletionStatusEx failed: %lu", GetLastError());
+    }
+    num_completions = 0;
+  }
+  wait_returned(reactor);
+
+  for (ULONG i = 0; i < num_completions; i++) {
+    reactor_entry_t* entry = (reactor_entry_t*)completions[i].lpOverlapped;
+    // reactor_stop's wakeup carries no entry.
+    if (!entry) continue;
+    entry->in_flight = false;
+    if (!entry->registered) continue;
+    if (entry->listening) {
+      UnregisterWait(entry->wait);
+      // Resets the event for the next wait.
+      WSANETWORKEVENTS network_events;
+      WSAEnumNetworkEvents(entry->fd, entry->event, &network_events);
+    }
+
+    dispatch(reactor, entry, REACTOR_READ);
+    if (entry->registered && (entry->interest & REACTOR_READ) && !entry->in_flight) {
+      iocp_arm_read(reactor, entry);
+    }
+  }
+
+  if (reactor->num_polled > 0) {
+    pollset_poll(reactor, 0);
+  }
+}
+
+static const reactor_ops_t iocp_ops = {
+    .name = "iocp",
+    .add = iocp_add,
+    .update = iocp_update,
+    .remove = iocp_remove,
+    .poll = iocp_poll,
+};
+
+reactor_backend_t reactor_backend_from_env(void) {
+  char* name = getenv("BACKEND");
+  if (!name || !strcmp(name, "SELECT")) {
+    return REACTOR_SELECT;
+  } else if (!strcmp(name, "POLL")) {
+    return REACTOR_POLL;
+  } else if (!strcmp(name, "IOCP")) {
+    return REACTOR_IOCP;
+  }
+  die("unknown BACKEND: %s", name);
+  return REACTOR_SELECT;
+}
+
+reactor_t* reactor_create(reactor_backend_t backend) {
+  reactor_t* reactor = (reactor_t*)xmalloc(sizeof(*reactor));
+  memset(reactor, 0, sizeof(*reactor));
+  FD_ZERO(&reactor->read_set);
+  FD_ZERO(&reactor->write_set);
+  switch (backend) {
+    case REACTOR_SELECT:
+      reactor->ops = &select_ops;
+      break;
+    case REACTOR_POLL:
+      reactor->ops = &poll_ops;
+      break;
+    case REACTOR_IOCP:
+      reactor->ops = &iocp_ops;
+      reactor->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+      if (!reactor->port) {
+        die("[REACTOR] CreateIoCompletionPort failed: %lu", GetLastError());
+      }
+      break;
+  }
+  timer_wheel_init(&reactor->timers, REACTOR_TIMER_TICK_MS, monotonic_ns() / 1000000);
+  return reactor;
+}
+
+const char* reactor_backend_name(const reactor_t* reactor) {
+  return reactor->ops->name;
+}
+
+timer_wheel_t* reactor_timers(reactor_t* reactor) {
+  return &reactor->timers;
+}
+
+bool reactor_register(reactor_t* reactor, int fd, int interest, reactor_callback_t callback, void* arg) {
+  if (fd >= reactor->max_entries) {
+    int max_entries = reactor->max_entries ? reactor->max_entries : 64;
+    while (max_entries <= fd) max_entries *= 2;
+    reactor->entries = (reactor_entry_t**)realloc(reactor->entries, sizeof(reactor_entry_t*) * max_entries);
+    if (!reactor->entries) {
+      die("[REACTOR] out of memory growing to %d fds", max_entries);
+    }
+    memset(&reactor->entries[reactor->max_entries], 0,
+           sizeof(reactor_entry_t*) * (max_entries - reactor->max_entries));
+    reactor->max_entries = max_entries;
+  }
+
+  reactor_entry_t* entry = (reactor_entry_t*)xmalloc(sizeof(*entry));
+  memset(entry, 0, sizeof(*entry));
+  entry->fd = fd;
+  entry->interest = interest;
+  entry->callback = callback;
+  entry->arg = arg;
+  entry->registered = true;
+  entry->poll_index = -1;
+  if (!reactor->ops->add(reactor, entry)) {
+    free(entry);
+    return false;
+  }
+  reactor->entries[fd] = entry;
+  return true;
+}
+
+void reactor_set_interest(reactor_t* reactor, int fd, int interest) {
+  reactor_entry_t* entry = reactor->entries[fd];
+  if (entry->interest != interest) {
+    entry->interest = interest;
+    reactor->ops->update(reactor, entry);
+  }
+}
+
+void reactor_unregister(reactor_t* reactor, int fd) {
+  reactor_entry_t* entry = reactor->entries[fd];
+  reactor->entries[fd] = NULL;
+  entry->registered = false;
+  reactor->ops->remove(reactor, entry);
+  entry->next_dead = reactor->dead;
+  reactor->dead = entry;
+}
+
+void reactor_defer(reactor_t* reactor, int fd, int events) {
+  reactor_entry_t* entry = reactor->entries[fd];
+  if (entry->deferred) {
+    entry->deferred_events |= events;
+    return;
+  }
+  entry->deferred = true;
+  entry->deferred_events = events;
+  entry->next_deferred = NULL;
+  if (reactor->deferred_tail) {
+    reactor->deferred_tail->next_deferred = entry;
+  } else {
+    reactor->deferred_head = entry;
+  }
+  reactor->deferred_tail = entry;
+}
+
+// Makes the calls deferred so far; those their callbacks defer wait for the
+// next wakeup.
+static void run_deferred(reactor_t* reactor) {
+  reactor_entry_t* entry = reactor->deferred_head;
+  reactor->deferred_head = reactor->deferred_tail = NULL;
+  while (entry) {
+    reactor_entry_t* next = entry->next_deferred;
+    entry->deferred = false;
+    if (entry->registered) {
+      entry->callback(reactor, entry->fd, entry->deferred_events, entry->arg);
+    }
+    entry = next;
+  }
+}
+
+// Frees the dead entries nothing refers to any more.
+static void free_dead(reactor_t* reactor) {
+  reactor_entry_t** link = &reactor->dead;
+  while (*link) {
+    reactor_entry_t* entry = *link;
+    if (entry->in_flight || entry->deferred) {
+      link = &entry->next_dead;
+    } else {
+      *link = entry->next_dead;
+      free(entry);
+    }
+  }
+}
+
+void reactor_run(reactor_t* reactor) {
+  reactor->stopped = false;
+  while (!reactor->stopped) {
+    // Deferred calls don't wait for readiness.
+    reactor->ops->poll(reactor, reactor->deferred_head ? 0 : timer_wheel_next_timeout_ms(&reactor->timers));
+    run_deferred(reactor);
+    timer_wheel_advance(&reactor->timers, monotonic_ns() / 1000000);
+    free_dead(reactor);
+  }
+}
+
+void reactor_stop(reactor_t* reactor) {
+  reactor->stopped = true;
+  if (reactor->port) {
+    PostQueuedCompletionStatus(reactor->port, 0, 0, NULL);
+  }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "timer-wheel.h"
+#include "utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Readiness-based event loop with interchangeable polling backends, so the
+// same connection code can be run (and measured) over select, WSAPoll and I/O
+// completion ports. The runtime counterpart of the templates in reactor.hpp.
+//
+// Sockets are registered with an interest set and a callback; reactor_run
+// calls the callback whenever the socket is ready for something it's
+// interested in, until reactor_stop. Readiness is level-triggered with every
+// backend: a callback that leaves data unread is called again. Errors and
+// hangups are reported as whatever the socket is interested in, so that the
+// next recv or send returns them.
+//
+// Callbacks may register, update and unregister any socket, including their
+// own. They should expect the occasional spurious wakeup: all sockets are
+// meant to be non-blocking.
+//
+// The reactor also runs a timer wheel (see timer-wheel.h), for timeouts of
+// any number of sockets at O(1) each: the wait for readiness is cut short
+// when the next timer is due, and expired timers' callbacks run after the
+// readiness callbacks of each wakeup. They may do anything those can.
+
+// Interest and readiness bits.
+#define REACTOR_READ 1
+#define REACTOR_WRITE 2
+
+typedef enum {
+  // select(); takes up to REACTOR_SELECT_SETSIZE sockets.
+  REACTOR_SELECT,
+  // WSAPoll over an array grown as sockets are registered.
+  REACTOR_POLL,
+  // An I/O completion port. Read readiness comes from a zero-byte WSARecv per
+  // socket, so a wakeup costs O(ready sockets) rather than O(registered
+  // ones); listening sockets use WSAEventSelect instead, and write interest,
+  // which is short-lived for sockets that mostly read, is checked with
+  // WSAPoll.
+  REACTOR_IOCP,
+} reactor_backend_t;
+
+// Sockets the select backend can watch at once.
+#define REACTOR_SELECT_SETSIZE 1024
+
+typedef struct reactor reactor_t;
+
+// Called with the REACTOR_* bits the socket is ready for; arg is what it was
+// registered with.
+typedef void (*reactor_callback_t)(reactor_t* reactor, int fd, int events, void* arg);
+
+// Returns the backend named by the BACKEND environment variable: SELECT (the
+// default), POLL or IOCP. Dies on an unknown name.
+reactor_backend_t reactor_backend_from_env(void);
+
+reactor_t* reactor_create(reactor_backend_t backend);
+
+const char* reactor_backend_name(const reactor_t* reactor);
+
+// The reactor's timers, ticking every 10 ms. Arm and cancel them from the
+// reactor's thread only.
+timer_wheel_t* reactor_timers(reactor_t* reactor);
+
+// Starts watching fd for the REACTOR_* bits in interest (possibly none).
+// Returns false if the backend can't take fd, e.g. select when its sets are
+// full. With IOCP a socket is tied to the reactor it was first registered
+// with, even after reactor_unregister.
+bool reactor_register(reactor_t* reactor, int fd, int interest, reactor_callback_t callback, void* arg);
+
+// Replaces the interest set of a registered fd.
+void reactor_set_interest(reactor_t* reactor, int fd, int interest);
+
+// Stops watching fd; its callback won't be called again. Call before closing
+// fd.
+void reactor_unregister(reactor_t* reactor, int fd);
+
+// Calls fd's callback with events once the readiness callbacks of the current
+// wakeup are done, whether fd is ready for them or not, after any calls
+// deferred before. For callbacks that have had their share of a wakeup: they
+// can let the other sockets have their turn, then carry on. Such a callback
+// would usually drop its interest in fd meanwhile, so that readiness doesn't
+// get it called twice. Deferring an already deferred fd adds to its events.
+void reactor_defer(reactor_t* reactor, int fd, int events);
+
+// Waits for readiness and calls callbacks until reactor_stop is called.
+void reactor_run(reactor_t* reactor);
+
+// Makes reactor_run return once the callbacks of the current wakeup are done.
+// Only the IOCP backend can be stopped from another thread; the others have to
+// be stopped from a callback.
+void reactor_stop(reactor_t* reactor);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,399 @@
+#pragma once
+
+// Header-only, statically dispatched counterpart of handler.h: the engine is a
+// template parameterized on the handler type, so on_data is inlined into the
+// read loop and buffer sizes are compile-time constants.
+//
+// A Handler is a class holding the protocol state of one connection:
+//
+//   struct my_handler {
+//     using out_type = sv::static_out<1024>;  // or handler_out_t
+//     static constexpr int recvbuf_size = 1024;
+//     static constexpr const char* name = "mine";
+//
+//     void on_connect(out_type& out);
+//     int on_data(const uint8_t* data, int len, out_type& out);
+//     void on_writable(out_type& out);
+//     void on_close();
+//   };
+//
+// The callbacks mean the same as their handler_t namesakes.
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "handler.h"
+#include "utils.h"
+
+namespace sv {
+
+// Output staging with a compile-time capacity, for handlers whose output per
+// read is bounded: unlike handler_out_t it never allocates.
+template <int N>
+struct static_out {
+  static constexpr int capacity = N;
+  uint8_t data[N];
+  // data[start, start + len) is still to be sent.
+  int start = 0;
+  int len = 0;
+
+  void push(uint8_t byte) {
+    assert(start + len < N);
+    data[start + len++] = byte;
+  }
+
+  void append(const void* p, int n) {
+    assert(start + len + n <= N);
+    memcpy(&data[start + len], p, n);
+    len += n;
+  }
+};
+
+// The engine drains either kind of output through out_peek/out_consume, with
+// the same meaning as handler_out_peek/handler_out_consume.
+template <int N>
+inline int out_peek(const static_out<N>& out, const uint8_t** data) {
+  *data = &out.data[out.start];
+  return out.len;
+}
+
+template <int N>
+inline void out_consume(static_out<N>& out, int n) {
+  out.len -= n;
+  out.start = out.len == 0 ? 0 : out.start + n;
+}
+
+template <int N>
+inline void out_reset(static_out<N>& out) {
+  out.start = 0;
+  out.len = 0;
+}
+
+template <int N>
+inline void out_push(static_out<N>& out, uint8_t byte) {
+  out.push(byte);
+}
+
+inline int out_peek(const handler_out_t& out, const uint8_t** data) { return handler_out_peek(&out, data); }
+inline void out_consume(handler_out_t& out, int n) { handler_out_consume(&out, n); }
+inline void out_reset(handler_out_t& out) { handler_out_reset(&out); }
+inline void out_push(handler_out_t& out, uint8_t byte) { handler_out_push(&out, byte); }
+
+// Runs a runtime handler_t through the static engine; every callback is an
+// indirect call. Used for protocols only available as handler_t, and as the
+// baseline the static handlers are measured against.
+struct dynamic_handler {
+  using out_type = handler_out_t;
+  static constexpr int recvbuf_size = 1024;
+  static constexpr const char* name = "dynamic";
+
+  // Set once at startup, before any connection is accepted.
+  static inline const handler_t* vtable = &echo_handler;
+
+  void* conn = nullptr;
+
+  void on_connect(out_type& out) { conn = vtable->on_connect(&out); }
+  int on_data(const uint8_t* data, int len, out_type& out) { return vtable->on_data(conn, data, len, &out); }
+  void on_writable(out_type& out) {
+    if (vtable->on_writable) vtable->on_writable(conn, &out);
+  }
+  void on_close() { vtable->on_close(conn); }
+};
+
+// The "^...$" protocol of echo-handler.c, as a static handler. Out may also
+// be handler_out_t, to stage output the way runtime handlers do.
+template <int SendBufSize = 1024, int RecvBufSize = 1024, typename Out = static_out<SendBufSize>>
+struct echo_static_handler {
+  using out_type = Out;
+  static constexpr int recvbuf_size = RecvBufSize;
+  static constexpr const char* name = "echo";
+
+  enum { WAIT_FOR_MSG, IN_MSG } state = WAIT_FOR_MSG;
+
+  void on_connect(out_type& out) { out_push(out, '*'); }
+
+  int on_data(const uint8_t* data, int len, out_type& out) {
+    for (int i = 0; i < len; i++) {
+      switch (state) {
+        case WAIT_FOR_MSG:
+          if (data[i] == '^') state = IN_MSG;
+          break;
+        case IN_MSG:
+          if (data[i] == '$') {
+            state = WAIT_FOR_MSG;
+          } else {
+            out_push(out, data[i] + 1);
+          }
+          break;
+      }
+    }
+    return len;
+  }
+
+  void on_writable(out_type& out) {}
+  void on_close() {}
+};
+
+// One connection driven by Handler: its protocol state, staged output and
+// unconsumed input. Engine-independent, so benchmarks can drive it directly.
+template <typename Handler>
+struct connection {
+  Handler handler;
+  typename Handler::out_type out{};
+  uint8_t recvbuf[Handler::recvbuf_size];
+  int recvbuf_end = 0;
+
+  void connect() {
+    handler = Handler();
+    out_reset(out);
+    recvbuf_end = 0;
+    handler.on_connect(out);
+  }
+
+  bool has_pending_output() const { return out.len > 0; }
+
+  // Free space for the next read, at recvbuf + recvbuf_end.
+  int recv_space() const { return Handler::recvbuf_size - recvbuf_end; }
+
+  // Offers the n bytes just read into recvbuf + recvbuf_end, plus whatever
+  // was left unconsumed before, to the handler. Returns false when the
+  // connection should be closed.
+  bool received(int n) {
+    recvbuf_end += n;
+    int consumed = handler.on_data(recvbuf, recvbuf_end, out);
+    if (consumed == HANDLER_CLOSE) return false;
+    recvbuf_end -= consumed;
+    if (recvbuf_end > 0) memmove(recvbuf, &recvbuf[consumed], recvbuf_end);
+    return true;
+  }
+
+  // Marks n staged bytes as sent; once everything is out, lets the handler
+  // stage more.
+  void sent(int n) {
+    out_consume(out, n);
+    if (out.len == 0) handler.on_writable(out);
+  }
+
+  void close() {
+    out_reset(out);
+    handler.on_close();
+  }
+};
+
+// The select-server.c event loop, over up to MaxFds connections of Handler.
+// Winsock socket handles are opaque and unbounded, so connections live in
+// slots of a fixed table, found from their handle through a hash, and the
+// ready sockets are read off the fd_arrays select leaves behind.
+template <typename Handler, int MaxFds = 1000>
+class select_reactor {
+ public:
+  select_reactor() {
+    // Handed out from the end, so slot 0 goes first.
+    for (int i = 0; i < MaxPeers; i++) free_slots_[i] = MaxPeers - 1 - i;
+    num_free_ = MaxPeers;
+  }
+
+  // Serves on portnum until a fatal error; never returns normally.
+  void run(int portnum) {
+    server_sockfd_ = listen_inet_socket(portnum);
+    make_socket_non_blocking(server_sockfd_);
+
+    FD_ZERO(&readable_fd_monitor_set_);
+    FD_ZERO(&writable_fd_monitor_set_);
+    FD_SET(server_sockfd_, &readable_fd_monitor_set_);
+
+    while (1) {
+      fd_set read_fd_set = readable_fd_monitor_set_;
+      fd_set write_fd_set = writable_fd_monitor_set_;
+
+      // The listener is always watched, so the sets are never both empty.
+      if (select(0, &read_fd_set, &write_fd_set, NULL, NULL) == SOCKET_ERROR) {
+        perror_die("[SELECT-REACTOR] select error");
+      }
+
+      // Collect before handling anything: handling changes what's watched.
+      accept_ready_ = false;
+      int num_ready = collect(read_fd_set, READY_READ, 0);
+      num_ready = collect(write_fd_set, READY_WRITE, num_ready);
+
+      for (int i = 0; i < num_ready; i++) {
+        int slot = ready_[i];
+        int events = events_[slot];
+        events_[slot] = 0;
+
+        connection<Handler>& peer = peers_[slot];
+        int fd = sockfds_[slot];
+        bool open = true;
+        if ((events & READY_READ) && !peer.has_pending_output()) open = on_readable(fd, peer);
+        if (open && (events & READY_WRITE)) open = on_writable(fd, peer);
+        if (open) {
+          update(slot);
+        } else {
+          release(slot);
+        }
+      }
+
+      if (accept_ready_) accept_peer();
+    }
+  }
+
+ private:
+  // One socket of every fd_set is the listener's.
+  static constexpr int MaxPeers = MaxFds < FD_SETSIZE - 1 ? MaxFds : FD_SETSIZE - 1;
+
+  // The handle -> slot hash: open addressing with linear probing, at most half
+  // full.
+  static constexpr int hash_size() {
+    int n = 1;
+    while (n < 2 * MaxPeers) n *= 2;
+    return n;
+  }
+  static constexpr int HashSize = hash_size();
+
+  enum { READY_READ = 1, READY_WRITE = 2 };
+
+  static unsigned hash(int fd) {
+    // Handles are multiples of 4.
+    return ((unsigned)fd >> 2) * 2654435761u & (HashSize - 1);
+  }
+
+  // Returns the slot serving fd, or -1.
+  int find(int fd) const {
+    for (unsigned i = hash(fd);; i = (i + 1) & (HashSize - 1)) {
+      int slot = index_[i] - 1;
+      if (slot < 0) return -1;
+      if (sockfds_[slot] == fd) return slot;
+    }
+  }
+
+  void index_insert(int fd, int slot) {
+    unsigned i = hash(fd);
+    while (index_[i]) i = (i + 1) & (HashSize - 1);
+    index_[i] = slot + 1;
+  }
+
+  void index_erase(int fd) {
+    unsigned i = hash(fd);
+    while (sockfds_[index_[i] - 1] != fd) i = (i + 1) & (HashSize - 1);
+    // Shift back the entries after i that would no longer be reachable from
+    // their home bucket across the hole.
+    for (unsigned j = (i + 1) & (HashSize - 1); index_[j]; j = (j + 1) & (HashSize - 1)) {
+      unsigned home = hash(sockfds_[index_[j] - 1]);
+      bool reachable = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!reachable) {
+        index_[i] = index_[j];
+        i = j;
+      }
+    }
+    index_[i] = 0;
+  }
+
+  // Adds the slot of each peer socket in set to ready_, with events; notes the
+  // listener instead.
+  int collect(const fd_set& set, int events, int num_ready) {
+    for (u_int i = 0; i < set.fd_count; i++) {
+      int fd = (int)set.fd_array[i];
+      if (fd == server_sockfd_) {
+        accept_ready_ = true;
+        continue;
+      }
+      int slot = find(fd);
+      if (slot < 0) continue;
+      if (!events_[slot]) ready_[num_ready++] = slot;
+      events_[slot] |= events;
+    }
+    return num_ready;
+  }
+
+  void accept_peer() {
+    int client_sockfd = accept(server_sockfd_, NULL, NULL);
+    if (client_sockfd == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSAEWOULDBLOCK) perror_die("accept");
+      return;
+    }
+    if (num_free_ == 0) {
+      // Full: turn this one connection away rather than the whole server.
+      printf("[SELECT-REACTOR] %d peers already, closing socket %d\n", MaxPeers, client_sockfd);
+      closesocket(client_sockfd);
+      return;
+    }
+    make_socket_non_blocking(client_sockfd);
+    int slot = free_slots_[--num_free_];
+    sockfds_[slot] = client_sockfd;
+    events_[slot] = 0;
+    index_insert(client_sockfd, slot);
+    peers_[slot].connect();
+    update(slot);
+  }
+
+  void release(int slot) {
+    int fd = sockfds_[slot];
+    FD_CLR(fd, &readable_fd_monitor_set_);
+    FD_CLR(fd, &writable_fd_monitor_set_);
+    index_erase(fd);
+    peers_[slot].close();
+    closesocket(fd);
+    free_slots_[num_free_++] = slot;
+  }
+
+  bool on_readable(int fd, connection<Handler>& peer) {
+    if (peer.recv_space() == 0) return false;
+    int n = recv(fd, (char*)&peer.recvbuf[peer.recvbuf_end], peer.recv_space(), 0);
+    if (n == 0) return false;
+    if (n == SOCKET_ERROR) {
+      if (WSAGetLastError() == WSAEWOULDBLOCK) return true;
+      perror_die("recv");
+    }
+    return peer.received(n);
+  }
+
+  bool on_writable(int fd, connection<Handler>& peer) {
+    while (peer.has_pending_output()) {
+      const uint8_t* data;
+      int len = out_peek(peer.out, &data);
+      int n = send(fd, (const char*)data, len, 0);
+      if (n == SOCKET_ERROR) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) return true;
+        perror_die("send");
+      }
+      peer.sent(n);
+      if (n < len) return true;
+    }
+    return true;
+  }
+
+  // Same R/W interest rule as select-server.c: wait for writability while
+  // output is staged, read otherwise. FD_SET adds a socket only once.
+  void update(int slot) {
+    int fd = sockfds_[slot];
+    if (peers_[slot].has_pending_output()) {
+      FD_CLR(fd, &readable_fd_monitor_set_);
+      FD_SET(fd, &writable_fd_monitor_set_);
+    } else {
+      FD_SET(fd, &readable_fd_monitor_set_);
+      FD_CLR(fd, &writable_fd_monitor_set_);
+    }
+  }
+
+  int server_sockfd_ = -1;
+  fd_set readable_fd_monitor_set_;
+  fd_set writable_fd_monitor_set_;
+  bool accept_ready_ = false;
+
+  connection<Handler> peers_[MaxPeers];
+  // The socket of each slot in use.
+  int sockfds_[MaxPeers];
+  // Readiness collected for each slot by the current select.
+  int events_[MaxPeers] = {};
+  // Slots with readiness collected, in the order found.
+  int ready_[MaxPeers];
+  // Slots not in use, the next one to hand out last.
+  int free_slots_[MaxPeers];
+  int num_free_;
+  // slot + 1 for each peer socket, 0 for an empty bucket.
+  int index_[HashSize] = {};
+};
+
+}  // namespace sv
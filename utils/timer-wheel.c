@@ -0,0 +1,150 @@
+#include "timer-wheel.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+_Static_assert((TIMER_WHEEL_SLOTS & SLOT_MASK) == 0 && TIMER_WHEEL_SLOTS >= 64,
+               "TIMER_WHEEL_SLOTS must be a power of 2, at least 64");
+
+void timer_wheel_init(timer_wheel_t* wheel, int tick_ms, uint64_t now_ms) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->tick_ms = tick_ms;
+  wheel->now_ms = now_ms;
+  wheel->current_tick = now_ms / tick_ms;
+}
+
+void wheel_timer_init(wheel_timer_t* timer, wheel_timer_callback_t callback, void* arg) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires_tick = 0;
+  timer->callback = callback;
+  timer->arg = arg;
+}
+
+bool wheel_timer_armed(const wheel_timer_t* timer) {
+  return timer->pprev != NULL;
+}
+
+static void link_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  int slot = timer->expires_tick & SLOT_MASK;
+  timer->next = wheel->slots[slot];
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = &wheel->slots[slot];
+  wheel->slots[slot] = timer;
+  wheel->occupied[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void unlink_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+  int slot = timer->expires_tick & SLOT_MASK;
+  if (!wheel->slots[slot]) {
+    wheel->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+  }
+}
+
+void timer_wheel_arm(timer_wheel_t* wheel, wheel_timer_t* timer, int timeout_ms) {
+  if (wheel_timer_armed(timer)) {
+    unlink_timer(wheel, timer);
+  } else {
+    wheel->num_armed++;
+  }
+  uint64_t expires_tick = (wheel->now_ms + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  // The current tick's slot has been run already.
+  timer->expires_tick = expires_tick > wheel->current_tick ? expires_tick : wheel->current_tick + 1;
+  link_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  if (wheel_timer_armed(timer)) {
+    unlink_timer(wheel, timer);
+    wheel->num_armed--;
+  }
+}
+
+void timer_wheel_set_now(timer_wheel_t* wheel, uint64_t now_ms) {
+  if (now_ms > wheel->now_ms) {
+    wheel->now_ms = now_ms;
+  }
+}
+
+int timer_wheel_next_timeout_ms(const timer_wheel_t* wheel) {
+  if (wheel->num_armed == 0) {
+    return -1;
+  }
+  // Scan the bitmap from the slot after the current one, wrapping around;
+  // the current slot itself comes last, a whole revolution away.
+  int start = (wheel->current_tick + 1) & SLOT_MASK;
+  int distance = TIMER_WHEEL_SLOTS;
+  for (int i = 0; i <= TIMER_WHEEL_SLOTS / 64; i++) {
+    int word = (start / 64 + i) % (TIMER_WHEEL_SLOTS / 64);
+    uint64_t bits = wheel->occupied[word];
+    if (i == 0) {
+      // Only slots from start on.
+      bits &= ~0ULL << (start % 64);
+    } else if (i == TIMER_WHEEL_SLOTS / 64) {
+      // Back at the first word: only the slots before start.
+      bits &= (1ULL << (start % 64)) - 1;
+    }
+    if (bits) {
+      int slot = word * 64 + __builtin_ctzll(bits);
+      distance = ((slot - start) & SLOT_MASK) + 1;
+      break;
+    }
+  }
+  uint64_t due_ms = (wheel->current_tick + distance) * wheel->tick_ms;
+  return due_ms > wheel->now_ms ? (int)(due_ms - wheel->now_ms) : 0;
+}
+
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now_ms) {
+  if (now_ms < wheel->now_ms) {
+    return;
+  }
+  wheel->now_ms = now_ms;
+  uint64_t target_tick = now_ms / wheel->tick_ms;
+  if (wheel->num_armed == 0) {
+    wheel->current_tick = target_tick;
+    return;
+  }
+  // Every slot comes up at most once, however far the wheel has to move.
+  if (target_tick - wheel->current_tick > TIMER_WHEEL_SLOTS) {
+    wheel->current_tick = target_tick - TIMER_WHEEL_SLOTS;
+  }
+
+  while (wheel->current_tick < target_tick) {
+    wheel->current_tick++;
+    int slot = wheel->current_tick & SLOT_MASK;
+    if (!wheel->slots[slot]) continue;
+
+    // Take the slot's timers off it, so that callbacks arming timers into it
+    // don't make this loop see them; timers they cancel unlink from pending.
+    wheel_timer_t* pending = wheel->slots[slot];
+    pending->pprev = &pending;
+    wheel->slots[slot] = NULL;
+    wheel->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+    while (pending) {
+      wheel_timer_t* timer = pending;
+      pending = timer->next;
+      if (pending) {
+        pending->pprev = &pending;
+      }
+      timer->next = NULL;
+      timer->pprev = NULL;
+      if (timer->expires_tick > target_tick) {
+        // Due in a later revolution.
+        link_timer(wheel, timer);
+        continue;
+      }
+      wheel->num_armed--;
+      timer->callback(timer, timer->arg);
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hashed timing wheel: timers hang off TIMER_WHEEL_SLOTS slots of tick_ms
+// each, a timer in the slot of the tick it expires in, so arming, re-arming
+// and cancelling are O(1) however many are armed. Timers further out than a
+// revolution sit in their slot for as many revolutions; they're looked at,
+// and left alone, each time the wheel passes it.
+//
+// Time only moves when timer_wheel_advance is called, from the loop the
+// wheel belongs to, which also runs the callbacks; timeouts are measured from
+// the time it was last given. Not thread-safe.
+
+// A power of 2.
+#define TIMER_WHEEL_SLOTS 1024
+
+typedef struct wheel_timer wheel_timer_t;
+
+typedef void (*wheel_timer_callback_t)(wheel_timer_t* timer, void* arg);
+
+// Embed in whatever the timer is for; it must not move while armed.
+struct wheel_timer {
+  wheel_timer_t* next;
+  // The link pointing at this timer; NULL while not armed.
+  wheel_timer_t** pprev;
+  uint64_t expires_tick;
+  wheel_timer_callback_t callback;
+  void* arg;
+};
+
+typedef struct {
+  int tick_ms;
+  // The last tick timers have been run for, and the time that was in.
+  uint64_t current_tick;
+  uint64_t now_ms;
+  int num_armed;
+  wheel_timer_t* slots[TIMER_WHEEL_SLOTS];
+  // A bit per non-empty slot, to find the next one without walking them all.
+  uint64_t occupied[TIMER_WHEEL_SLOTS / 64];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* wheel, int tick_ms, uint64_t now_ms);
+
+void wheel_timer_init(wheel_timer_t* timer, wheel_timer_callback_t callback, void* arg);
+
+bool wheel_timer_armed(const wheel_timer_t* timer);
+
+// (Re)arms timer to expire timeout_ms after the wheel's current time, rounded
+// up to a tick, replacing any expiry it had.
+void timer_wheel_arm(timer_wheel_t* wheel, wheel_timer_t* timer, int timeout_ms);
+
+// Disarms timer if it's armed.
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+// Milliseconds from the wheel's current time until the next slot with timers
+// in it comes up, 0 if one is due already, or -1 if no timer is armed. Meant
+// as the timeout of the loop's wait.
+int timer_wheel_next_timeout_ms(const timer_wheel_t* wheel);
+
+// Moves the wheel's current time, which timers are armed from, forward to
+// now_ms without running any timer. For loops to call as soon as their wait
+// returns, so that what they arm before the next timer_wheel_advance isn't
+// measured from before the wait.
+void timer_wheel_set_now(timer_wheel_t* wheel, uint64_t now_ms);
+
+// Moves the wheel to now_ms and calls the callbacks of the timers that
+// expired by then, disarmed before they're called. Callbacks may arm and
+// cancel any timer.
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now_ms);
+
+#ifdef __cplusplus
+}
+#endif
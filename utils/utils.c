@@ -23,7 +23,7 @@ void cleanupWinsock() {
   WSACleanup();
 }
 
-void die(char* fmt, ...) {
+void die(const char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
   vfprintf(stderr, fmt, args);
@@ -40,7 +40,7 @@ void* xmalloc(size_t size) {
   return ptr;
 }
 
-void perror_die(char* msg) {
+void perror_die(const char* msg) {
   perror(msg);
   exit(EXIT_FAILURE);
 }
@@ -55,7 +55,31 @@ void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen) {
   }
 }
 
+// Receives the listening socket a prefork-server master hands down: its
+// WSADuplicateSocket info arrives on stdin.
+static int inherited_listen_socket(void) {
+  WSAPROTOCOL_INFOA info;
+  HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+  for (DWORD have = 0; have < sizeof(info);) {
+    DWORD n;
+    if (!ReadFile(input, (char*)&info + have, sizeof(info) - have, &n, NULL) || n == 0) {
+      die("reading the inherited listening socket from stdin failed");
+    }
+    have += n;
+  }
+
+  SOCKET sockfd = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+  if (sockfd == INVALID_SOCKET) {
+    die("WSASocket on the inherited listening socket failed: %d", WSAGetLastError());
+  }
+  return (int)sockfd;
+}
+
 int listen_inet_socket(int portnum) {
+  if (getenv("INHERITED_LISTENER")) {
+    return inherited_listen_socket();
+  }
+
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     perror_die("ERROR opening socket");
@@ -85,6 +109,37 @@ int listen_inet_socket(int portnum) {
   return sockfd;
 }
 
+int send_all(int sockfd, const void* buf, int len) {
+  const char* p = (const char*)buf;
+  while (len > 0) {
+    int sent = send(sockfd, p, len, 0);
+    if (sent == SOCKET_ERROR) {
+      return SOCKET_ERROR;
+    }
+    p += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+int getenv_int(const char* name, int default_value) {
+  char* value = getenv(name);
+  return value ? atoi(value) : default_value;
+}
+
+uint64_t monotonic_ns(void) {
+  static LARGE_INTEGER frequency;
+  if (!frequency.QuadPart) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  // Split to avoid overflowing counter * 1e9.
+  uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+  uint64_t rest = counter.QuadPart % frequency.QuadPart;
+  return seconds * 1000000000ULL + rest * 1000000000ULL / frequency.QuadPart;
+}
+
 void make_socket_non_blocking(int sockfd) {
   u_long mode = 1;
   if (ioctlsocket(sockfd, FIONBIO, &mode) != NO_ERROR) {
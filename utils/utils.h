@@ -4,22 +4,27 @@
 #include <ws2tcpip.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 int initializeWinsock();
 void cleanupWinsock();
 
 // Dies (exits with a failure status) after printing the given printf-like
 // message to stdout.
-void die(char* fmt, ...);
+void die(const char* fmt, ...);
 
 // Wraps malloc with error checking: dies if malloc fails.
 void* xmalloc(size_t size);
 
 // Dies (exits with a failure status) after printing the current perror status
 // prefixed with msg.
-void perror_die(char* msg);
+void perror_die(const char* msg);
 
 // Reports a peer connection to stdout. sa is the data populated by a successful
 // accept() call.
@@ -27,7 +32,26 @@ void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen);
 
 // Creates a bound and listening INET socket on the given port number. Returns
 // the socket fd when successful; dies in case of errors.
+//
+// In a worker of prefork-server (INHERITED_LISTENER set) it instead returns
+// the master's listening socket, so every server's loop runs unchanged as a
+// prefork worker.
 int listen_inet_socket(int portnum);
 
+// Sends all len bytes of buf on a blocking socket, retrying partial sends.
+// Returns 0 on success, SOCKET_ERROR otherwise.
+int send_all(int sockfd, const void* buf, int len);
+
+// Returns the value of the environment variable name parsed as an integer, or
+// default_value if it isn't set.
+int getenv_int(const char* name, int default_value);
+
+// Returns a monotonic timestamp in nanoseconds, for measuring intervals.
+uint64_t monotonic_ns(void);
+
 // Sets the given socket into non-blocking mode.
-void make_socket_non_blocking(int sockfd);
\ No newline at end of file
+void make_socket_non_blocking(int sockfd);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
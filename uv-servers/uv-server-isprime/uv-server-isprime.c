@@ -12,24 +12,18 @@
 
 #define N_BACKLOG    64
 
-#define SENDBUF_SIZE 1024
-
 typedef struct {
     uint64_t number;
     uv_tcp_t* client;
-    char sendbuf[SENDBUF_SIZE];
-    int sendbuf_end;
+    // Response for the last request; always a string literal, so it can be
+    // written from directly and outlives the write.
+    const char* response;
 } peer_state_t;
 
-// Sets sendbuf/sendbuf_end in the given state to the contents of the
-// NULL-terminated string passed as 'str'.
+// Sets the response to send back to the peer to the NULL-terminated string
+// literal passed as 'str'.
 void set_peer_sendbuf(peer_state_t* state, const char* str) {
-    int i = 0;
-    for (; str[i]; ++i) {
-        assert(i < SENDBUF_SIZE);
-        state->sendbuf[i] = str[i];
-    }
-    state->sendbuf_end = i;
+    state->response = str;
 }
 
 void on_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
@@ -75,7 +69,7 @@ void on_work_completed(uv_work_t* req, int status) {
 
     peer_state_t* peerstate = (peer_state_t*)req->data;
     printf("work completed: %" PRIu64 "\n", peerstate->number);
-    uv_buf_t writebuf = uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
+    uv_buf_t writebuf = uv_buf_init((char*)peerstate->response, strlen(peerstate->response));
     uv_write_t* writereq = (uv_write_t*)xmalloc(sizeof(*writereq));
     writereq->data = peerstate;
     int rc = uv_write(writereq, (uv_stream_t*)peerstate->client, &writebuf, 1, on_sent_response);
@@ -129,7 +123,7 @@ void on_peer_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
             uint64_t t2 = uv_hrtime();
             printf("Elapsed %" PRIu64 " ns\n", t2 - t1);
 
-            uv_buf_t writebuf = uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
+            uv_buf_t writebuf = uv_buf_init((char*)peerstate->response, strlen(peerstate->response));
             uv_write_t* writereq = (uv_write_t*)xmalloc(sizeof(*writereq));
             writereq->data = peerstate;
             if ((rc = uv_write(writereq, (uv_stream_t*)client, &writebuf, 1, on_sent_response)) < 0) {
@@ -169,7 +163,7 @@ void on_peer_connected(uv_stream_t* server, int status) {
         report_peer_connected((const struct sockaddr_in*)&peername, namelen);
 
         peer_state_t* peerstate = (peer_state_t*)xmalloc(sizeof(*peerstate));
-        peerstate->sendbuf_end = 0;
+        peerstate->response = NULL;
         client->data = peerstate;
 
         rc = uv_read_start((uv_stream_t*)client, on_alloc_buffer, on_peer_read);
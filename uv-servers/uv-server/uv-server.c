@@ -1,47 +1,194 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "uv.h"
 
+#include "admission.h"
+#include "bufpool.h"
+#include "handler.h"
 #include "utils.h"
 
 #define N_BACKLOG 64
 
-typedef enum {
-    INITIAL_ACK,
-    WAIT_FOR_MSG,
-    IN_MSG,
-} ProcessingState;
-
-#define SENDBUF_SIZE 1024
-
-typedef struct {
-    ProcessingState state;
-    char send_buf[SENDBUF_SIZE];
-    int send_buf_end;
+#define RECVBUF_SIZE 1024
+
+// Receive buffers allocated at a time.
+#define RECVBUF_SLAB 64
+
+// Size of the buffers libuv reads into. A read buffer is only taken when data
+// has arrived and is returned as soon as the handler has seen it, so the loop
+// only ever needs one.
+#define READ_BUFFER_SIZE 65536
+
+// Staged chunks handed to a single uv_write.
+#define MAX_WRITE_BUFS 16
+
+// Defaults for BUDGET_BYTES and BUDGET_FRAMES.
+#define DEFAULT_BUDGET_BYTES (64 * 1024)
+#define DEFAULT_BUDGET_FRAMES 64
+
+typedef struct peer_state {
+    // Protocol state owned by the handler.
+    void* conn;
+    handler_out_t out;
+    // Bytes of out handed to the uv_write in flight.
+    int write_len;
+    // Bytes received but not yet consumed by the handler. recv_buf is borrowed
+    // from recv_bufs while there are any, and NULL otherwise.
+    uint8_t* recv_buf;
+    int recv_buf_end;
     uv_tcp_t* client;
+    // The loop iteration the budget below is for, and what's left of it.
+    uint64_t budget_turn;
+    int budget_bytes;
+    int budget_frames;
+    // In the ready queue, waiting for its next turn; reading is stopped
+    // meanwhile.
+    bool queued;
+    struct peer_state* queue_prev;
+    struct peer_state* queue_next;
 } peer_state_t;
 
+const handler_t* handler;
+
+// Limits the peers served at once (see admission.h).
+admission_t admission;
+
+// Buffers lent to peers while they have data in flight; an idle peer holds
+// none.
+bufpool_t read_buffers;
+bufpool_t recv_bufs;
+
+// BUDGET_BYTES and BUDGET_FRAMES: how much a peer may receive, and how many
+// frames it may have answered, per loop iteration. libuv reads a socket until
+// it runs dry, so without them one peer streaming large frames would hold up
+// every other.
+int budget_bytes;
+int budget_frames;
+
+// Counts loop iterations, so that budgets are renewed with each.
+uint64_t turn;
+uv_prepare_t turn_counter;
+
+// Peers that used up their budget, oldest first. They resume reading in the
+// next iteration, and ready_idle keeps the loop from blocking until then.
+peer_state_t* ready_head = NULL;
+peer_state_t* ready_tail = NULL;
+uv_idle_t ready_idle;
+
+// Connections libuv has reported on the listening stream while admission was
+// paused, and that haven't been accepted yet. On Windows libuv keeps several
+// AcceptEx calls posted and reports each one that completes, whether or not
+// the previous one was accepted, so there can be many; on_client_closed
+// accepts them as room frees up.
+uv_stream_t* listening_stream = NULL;
+int pending_accepts = 0;
+
+void accept_peer(uv_stream_t* server_stream);
+
 /// @brief
 /// @param handle
-/// @param suggested_size 65536 at the moment in most cases
+/// @param suggested_size 65536 at the moment in most cases; ignored, reads
+/// always get a READ_BUFFER_SIZE buffer
 /// @param buf
 void on_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-    buf->base = (char*)xmalloc(suggested_size);
-    buf->len = suggested_size;
+    buf->base = (char*)bufpool_get(&read_buffers);
+    buf->len = READ_BUFFER_SIZE;
+}
+
+void on_received_message(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf);
+
+void on_turn(uv_prepare_t* handle) {
+    turn++;
+}
+
+// Charges what the peer did to its budget for this iteration. Returns false
+// once the budget is used up.
+bool charge_budget(peer_state_t* peer_handler, int bytes, int frames) {
+    if (peer_handler->budget_turn != turn) {
+        peer_handler->budget_turn = turn;
+        peer_handler->budget_bytes = budget_bytes;
+        peer_handler->budget_frames = budget_frames;
+    }
+    peer_handler->budget_bytes -= bytes;
+    peer_handler->budget_frames -= frames;
+    return peer_handler->budget_bytes > 0 && peer_handler->budget_frames > 0;
+}
+
+void unqueue_peer(peer_state_t* peer_handler) {
+    if (peer_handler->queue_prev) {
+        peer_handler->queue_prev->queue_next = peer_handler->queue_next;
+    } else {
+        ready_head = peer_handler->queue_next;
+    }
+    if (peer_handler->queue_next) {
+        peer_handler->queue_next->queue_prev = peer_handler->queue_prev;
+    } else {
+        ready_tail = peer_handler->queue_prev;
+    }
+    peer_handler->queued = false;
+}
+
+// Resumes reading from the peers that were out of budget, oldest first.
+void on_ready_idle(uv_idle_t* handle) {
+    while (ready_head) {
+        peer_state_t* peer_handler = ready_head;
+        unqueue_peer(peer_handler);
+        // A peer that's writing resumes reading once the write is done.
+        if (peer_handler->write_len == 0) {
+            int return_code = uv_read_start((uv_stream_t*)peer_handler->client, on_alloc_buffer, on_received_message);
+            if (return_code < 0) die("[ON_READY_IDLE] uv_read_start failed: %s", uv_strerror(return_code));
+        }
+    }
+    uv_idle_stop(handle);
+}
+
+// Stops reading from a peer that used up its budget until the next iteration.
+void queue_peer(peer_state_t* peer_handler) {
+    uv_read_stop((uv_stream_t*)peer_handler->client);
+    peer_handler->queued = true;
+    peer_handler->queue_prev = ready_tail;
+    peer_handler->queue_next = NULL;
+    if (ready_tail) {
+        ready_tail->queue_next = peer_handler;
+    } else {
+        ready_head = peer_handler;
+        uv_idle_start(&ready_idle, on_ready_idle);
+    }
+    ready_tail = peer_handler;
+}
+
+void free_peer_state(peer_state_t* peer_handler) {
+    if (peer_handler->queued) unqueue_peer(peer_handler);
+    handler_out_reset(&peer_handler->out);
+    handler->on_close(peer_handler->conn);
+    if (peer_handler->recv_buf) bufpool_put(&recv_bufs, peer_handler->recv_buf);
+    free(peer_handler);
 }
 
 void on_client_closed(uv_handle_t* handle) {
     uv_tcp_t* client = (uv_tcp_t*)handle;
-    if (client->data) free(client->data);
+    if (client->data) {
+        free_peer_state((peer_state_t*)client->data);
+        admission_leave(&admission);
+    }
     free(client);
+
+    while (pending_accepts > 0 && !admission_paused(&admission)) {
+        pending_accepts--;
+        accept_peer(listening_stream);
+    }
 }
 
+void flush_peer_output(peer_state_t* peer_handler);
+
 void on_sent_buf(uv_write_t* req, int status) {
     if (status) die("Write error: %s\n", uv_strerror(status));
 
     peer_state_t* peer_handler = (peer_state_t*)req->data;
+    handler_out_t* out = &peer_handler->out;
 
     // Kill switch for testing leaks in the server. When a client sends a message
     // ending with WXY (note the shift-by-1 in send_buf), this signals the server
@@ -49,21 +196,54 @@ void on_sent_buf(uv_write_t* req, int status) {
     // server under valgrind can now track memory leaks, and a run should be
     // clean except a single uv_tcp_t allocated for the client that sent the kill
     // signal (it's still connected when we stop the loop and exit).
-    if (peer_handler->send_buf_end >= 3 && peer_handler->send_buf[peer_handler->send_buf_end - 3] == 'X' &&
-        peer_handler->send_buf[peer_handler->send_buf_end - 2] == 'Y' &&
-        peer_handler->send_buf[peer_handler->send_buf_end - 1] == 'Z') {
-        free(peer_handler);
+    const sendbuf_chunk_t* tail = out->tail;
+    if (peer_handler->write_len == out->len && tail->end - tail->start >= 3 && tail->data[tail->end - 3] == 'X' &&
+        tail->data[tail->end - 2] == 'Y' && tail->data[tail->end - 1] == 'Z') {
+        free_peer_state(peer_handler);
         free(req);
         uv_stop(uv_default_loop());
         return;
     }
 
-    peer_handler->send_buf_end = 0;
+    handler_out_consume(out, peer_handler->write_len);
+    peer_handler->write_len = 0;
     free(req);
+
+    // The handler may stage more output once the previous batch is out.
+    if (out->len == 0 && handler->on_writable) handler->on_writable(peer_handler->conn, out);
+    if (out->len > 0) {
+        flush_peer_output(peer_handler);
+        return;
+    }
+
+    // Nothing left in flight: go back to reading from the peer, unless it's
+    // waiting for its next turn.
+    if (peer_handler->queued) return;
+    int return_code = uv_read_start((uv_stream_t*)peer_handler->client, on_alloc_buffer, on_received_message);
+    if (return_code < 0) die("[ON_SENT_BUF] uv_read_start failed: %s", uv_strerror(return_code));
 }
 
+// Writes the output staged by the handler, up to MAX_WRITE_BUFS chunks at a
+// time. Reading is paused until the write completes, so out isn't touched
+// while libuv is still sending from it.
+void flush_peer_output(peer_state_t* peer_handler) {
+    uv_read_stop((uv_stream_t*)peer_handler->client);
+
+    uv_buf_t send_bufs[MAX_WRITE_BUFS];
+    int num_bufs = 0;
+    peer_handler->write_len = 0;
+    for (sendbuf_chunk_t* chunk = peer_handler->out.head; chunk && num_bufs < MAX_WRITE_BUFS; chunk = chunk->next) {
+        send_bufs[num_bufs++] = uv_buf_init((char*)&chunk->data[chunk->start], chunk->end - chunk->start);
+        peer_handler->write_len += chunk->end - chunk->start;
+    }
 
-/// @brief Note: Must be responsible for freeing the buffer 
+    uv_write_t* send_req = (uv_write_t*)xmalloc(sizeof(*send_req));
+    send_req->data = peer_handler;
+    int return_code = uv_write(send_req, (uv_stream_t*)peer_handler->client, send_bufs, num_bufs, on_sent_buf);
+    if (return_code < 0) die("[FLUSH_PEER_OUTPUT] uv_write failed: %s", uv_strerror(return_code));
+}
+
+/// @brief Note: Must be responsible for returning the buffer to read_buffers
 /// @param client 
 /// @param nread data available status
 /// @param buf
@@ -74,66 +254,59 @@ void on_received_message(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf
     } else if (nread > 0) {
         assert(buf->len >= nread);
         peer_state_t* peer_handler = (peer_state_t*)client->data;
-        if (peer_handler->state == INITIAL_ACK) {
-            free(buf->base);
-            return;
-        }
 
-        for (int i = 0; i < nread; ++i) {
-            switch (peer_handler->state) {
-                case WAIT_FOR_MSG:
-                    if (buf->base[i] == '^') peer_handler->state = IN_MSG;
-                    break;
-                case IN_MSG:
-                    if (buf->base[i] == '$') {
-                        peer_handler->state = WAIT_FOR_MSG;
-                    } else {
-                        assert(peer_handler->send_buf_end < SENDBUF_SIZE);
-                        peer_handler->send_buf[peer_handler->send_buf_end++] = buf->base[i] + 1;
-                    }
-                    break;
-                default:
-                    break;
+        // Hand the read buffer to the handler directly unless an unconsumed
+        // tail of earlier data has to go first.
+        const uint8_t* data = (const uint8_t*)buf->base;
+        int len = nread;
+        if (peer_handler->recv_buf_end > 0) {
+            if (peer_handler->recv_buf_end + nread > RECVBUF_SIZE) {
+                fprintf(stderr, "Frame exceeds %d bytes\n", RECVBUF_SIZE);
+                uv_close((uv_handle_t*)client, on_client_closed);
+                bufpool_put(&read_buffers, buf->base);
+                return;
             }
+            memcpy(&peer_handler->recv_buf[peer_handler->recv_buf_end], buf->base, nread);
+            peer_handler->recv_buf_end += nread;
+            data = peer_handler->recv_buf;
+            len = peer_handler->recv_buf_end;
         }
 
-        if (peer_handler->send_buf_end > 0) {
-            uv_buf_t send_buf = uv_buf_init(peer_handler->send_buf, peer_handler->send_buf_end);
-            uv_write_t* send_req = (uv_write_t*)xmalloc(sizeof(*send_req));
-            send_req->data = peer_handler;
-            int return_code = uv_write(send_req, (uv_stream_t*)client, &send_buf, 1, on_sent_buf);
-            if (return_code < 0) die("[on_received_message] uv_write failed: %s", uv_strerror(return_code));
+        int frames = peer_handler->out.frames;
+        int consumed = handler->on_data(peer_handler->conn, data, len, &peer_handler->out);
+        if (consumed == HANDLER_CLOSE || len - consumed > RECVBUF_SIZE) {
+            uv_close((uv_handle_t*)client, on_client_closed);
+            bufpool_put(&read_buffers, buf->base);
+            return;
+        }
+        // Keep the unconsumed tail, if any, in a buffer of the peer's own;
+        // give the buffer back once there's none.
+        if (len > consumed && !peer_handler->recv_buf) {
+            peer_handler->recv_buf = (uint8_t*)bufpool_get(&recv_bufs);
+        }
+        if (peer_handler->recv_buf) memmove(peer_handler->recv_buf, data + consumed, len - consumed);
+        peer_handler->recv_buf_end = len - consumed;
+        if (peer_handler->recv_buf_end == 0 && peer_handler->recv_buf) {
+            bufpool_put(&recv_bufs, peer_handler->recv_buf);
+            peer_handler->recv_buf = NULL;
         }
-    }
-    free(buf->base);
-}
-
-void on_sent_init_ack(uv_write_t* req, int status) {
-    if (status) die("Write init ack error: %s\n", uv_strerror(status));
-
-    peer_state_t* peer_handler = (peer_state_t*)req->data;
-    peer_handler->state = WAIT_FOR_MSG;
-    peer_handler->send_buf_end = 0;
-
-    int return_code = uv_read_start((uv_stream_t*)peer_handler->client, on_alloc_buffer, on_received_message);
-    if (return_code < 0) die("[ON_SENT_INIT_ACK] uv_read_start failed: %s", uv_strerror(return_code));
-
-    free(req);
-}
 
-void on_peer_connected(uv_stream_t* server_stream, int status) {
-    if (status < 0) {
-        fprintf(stderr, "Peer connection error: %s\n", uv_strerror(status));
-        return;
+        if (peer_handler->out.len > 0) flush_peer_output(peer_handler);
+        if (!charge_budget(peer_handler, nread, peer_handler->out.frames - frames)) queue_peer(peer_handler);
     }
+    // Errors may come without a buffer.
+    if (buf->base) bufpool_put(&read_buffers, buf->base);
+}
 
+// Accepts one connection libuv has reported on server_stream.
+void accept_peer(uv_stream_t* server_stream) {
     // A TCP client will represent the connected peer; it's allocated on the heap and only
     // released when the client disconnects. This client holds a pointer to
     // peer_state_t in its data field; this peer state tracks the protocol state
     // with this client throughout interaction.
     uv_tcp_t* client = (uv_tcp_t*)xmalloc(sizeof(*client));
     int return_code = uv_tcp_init(uv_default_loop(), client);
-    if (return_code < 0) die("[ON_PEER_CONNECTED] uv_tcp_init failed: %s", uv_strerror(return_code));
+    if (return_code < 0) die("[ACCEPT_PEER] uv_tcp_init failed: %s", uv_strerror(return_code));
 
     client->data = NULL;
 
@@ -143,29 +316,56 @@ void on_peer_connected(uv_stream_t* server_stream, int status) {
         int name_len = sizeof(peer_name);
         // Copy the address of connected peer to the client.
         return_code = uv_tcp_getpeername(client, (struct sockaddr*)&peer_name, &name_len);
-        if (return_code < 0) die("[ON_PEER_CONNECTED] uv_tcp_getpeername failed: %s", uv_strerror(return_code));
+        if (return_code < 0) die("[ACCEPT_PEER] uv_tcp_getpeername failed: %s", uv_strerror(return_code));
 
         report_peer_connected((const struct sockaddr_in*)&peer_name, name_len);
 
+        if (!admission_try_enter(&admission)) {
+            // OVERLOAD=REJECT: a short error frame, then close.
+            uv_buf_t busy = uv_buf_init(OVERLOAD_MESSAGE, sizeof(OVERLOAD_MESSAGE) - 1);
+            uv_try_write((uv_stream_t*)client, &busy, 1);
+            uv_close((uv_handle_t*)client, on_client_closed);
+            return;
+        }
+
         peer_state_t* peer_handler = (peer_state_t*)xmalloc(sizeof(*peer_handler));
-        peer_handler->state = INITIAL_ACK;
-        peer_handler->send_buf[0] = '*';
-        peer_handler->send_buf_end = 1;
+        peer_handler->out = (handler_out_t){0};
+        peer_handler->write_len = 0;
+        peer_handler->recv_buf = NULL;
+        peer_handler->recv_buf_end = 0;
         peer_handler->client = client;
+        peer_handler->budget_turn = 0;
+        peer_handler->queued = false;
+        peer_handler->conn = handler->on_connect(&peer_handler->out);
 
         client->data = peer_handler;
 
-        uv_buf_t send_buf = uv_buf_init(peer_handler->send_buf, peer_handler->send_buf_end);
-        uv_write_t* send_req = (uv_write_t*)xmalloc(sizeof(*send_req));
-        send_req->data = peer_handler;
-        return_code = uv_write(send_req, (uv_stream_t*)client, &send_buf, 1, on_sent_init_ack);
-        if (return_code < 0) die("[ON_PEER_CONNECTED] uv_write failed: %s", uv_strerror(return_code));
-
+        // The greeting staged by on_connect (e.g. the initial ACK) goes out
+        // before anything is read from the peer.
+        if (peer_handler->out.len > 0) {
+            flush_peer_output(peer_handler);
+        } else {
+            return_code = uv_read_start((uv_stream_t*)client, on_alloc_buffer, on_received_message);
+            if (return_code < 0) die("[ACCEPT_PEER] uv_read_start failed: %s", uv_strerror(return_code));
+        }
     } else {
         uv_close((uv_handle_t*)client, on_client_closed);
     }
 }
 
+void on_peer_connected(uv_stream_t* server_stream, int status) {
+    if (status < 0) {
+        fprintf(stderr, "Peer connection error: %s\n", uv_strerror(status));
+        return;
+    }
+    if (admission_paused(&admission)) {
+        listening_stream = server_stream;
+        pending_accepts++;
+        return;
+    }
+    accept_peer(server_stream);
+}
+
 int main(int argc, const char** argv) {
     if (initializeWinsock() != 0) return 1;
 
@@ -174,7 +374,14 @@ int main(int argc, const char** argv) {
     int portnum = 9090;
     if (argc >= 2) portnum = atoi(argv[1]);
 
-    printf("[MAIN] Serving on port %d\n", portnum);
+    handler = handler_from_env();
+    admission_init_from_env(&admission, 0);
+    bufpool_init(&read_buffers, READ_BUFFER_SIZE, 1);
+    bufpool_init(&recv_bufs, RECVBUF_SIZE, RECVBUF_SLAB);
+    budget_bytes = getenv_int("BUDGET_BYTES", DEFAULT_BUDGET_BYTES);
+    budget_frames = getenv_int("BUDGET_FRAMES", DEFAULT_BUDGET_FRAMES);
+    if (budget_bytes <= 0 || budget_frames <= 0) die("need BUDGET_BYTES > 0 and BUDGET_FRAMES > 0");
+    printf("[MAIN] Serving %s on port %d\n", handler->name, portnum);
 
     int return_code;
     uv_tcp_t server_stream;
@@ -196,6 +403,12 @@ int main(int argc, const char** argv) {
     return_code = uv_listen((uv_stream_t*)&server_stream, N_BACKLOG, on_peer_connected);
     if (return_code < 0) die("[MAIN] uv_listen failed: %s", uv_strerror(return_code));
 
+    // Renews budgets before each poll for I/O; it doesn't keep the loop alive.
+    uv_prepare_init(uv_default_loop(), &turn_counter);
+    uv_prepare_start(&turn_counter, on_turn);
+    uv_unref((uv_handle_t*)&turn_counter);
+    uv_idle_init(uv_default_loop(), &ready_idle);
+
     // Run the libuv event loop.
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
 